@@ -33,6 +33,7 @@ subject to the following restrictions:
 // PosixThreadSupport helps to initialize/shutdown libspe2, start/stop SPU tasks and communication
 // Setup and initialize SPU/CELL/Libspe2
 PosixThreadSupport::PosixThreadSupport(ThreadConstructionInfo& threadConstructionInfo)
+: m_mainSemaphore(0)
 {
 	startThreads(threadConstructionInfo);
 }
@@ -47,9 +48,6 @@ PosixThreadSupport::~PosixThreadSupport()
 #define NAMED_SEMAPHORES
 #endif
 
-// this semaphore will signal, if and how many threads are finished with their work
-static sem_t* mainSemaphore=0;
-
 static sem_t* createSem(const char* baseName)
 {
 	static int semCount = 0;
@@ -103,19 +101,19 @@ static void *threadFunction(void *argument)
 			btAssert(status->m_status);
 			status->m_userThreadFunc(userPtr,status->m_lsMemory);
 			status->m_status = 2;
-			checkPThreadFunction(sem_post(mainSemaphore));
+			checkPThreadFunction(sem_post(status->mainSemaphore));
 	                status->threadUsed++;
 		} else {
 			//exit Thread
 			status->m_status = 3;
-			checkPThreadFunction(sem_post(mainSemaphore));
-			printf("Thread with taskId %i exiting\n",status->m_taskId);
+			checkPThreadFunction(sem_post(status->mainSemaphore));
+			//printf("Thread with taskId %i exiting\n",status->m_taskId);
 			break;
 		}
 		
 	}
 
-	printf("Thread TERMINATED\n");
+	//printf("Thread TERMINATED\n");
 	return 0;
 
 }
@@ -168,7 +166,7 @@ void PosixThreadSupport::waitForResponse(unsigned int *puiArgument0, unsigned in
 	btAssert(m_activeSpuStatus.size());
 
         // wait for any of the threads to finish
-	checkPThreadFunction(sem_wait(mainSemaphore));
+	checkPThreadFunction(sem_wait(m_mainSemaphore));
         
 	// get at least one thread which has finished
         size_t last = -1;
@@ -196,19 +194,20 @@ void PosixThreadSupport::waitForResponse(unsigned int *puiArgument0, unsigned in
 
 void PosixThreadSupport::startThreads(ThreadConstructionInfo& threadConstructionInfo)
 {
-        printf("%s creating %i threads.\n", __FUNCTION__, threadConstructionInfo.m_numThreads);
+        //printf("%s creating %i threads.\n", __FUNCTION__, threadConstructionInfo.m_numThreads);
 	m_activeSpuStatus.resize(threadConstructionInfo.m_numThreads);
         
-	mainSemaphore = createSem("main");                
-	//checkPThreadFunction(sem_wait(mainSemaphore));
+	m_mainSemaphore = createSem("main");                
+	//checkPThreadFunction(sem_wait(m_mainSemaphore));
    
 	for (int i=0;i < threadConstructionInfo.m_numThreads;i++)
 	{
-		printf("starting thread %d\n",i);
+		//printf("starting thread %d\n",i);
 
 		btSpuStatus&	spuStatus = m_activeSpuStatus[i];
 
 		spuStatus.startSemaphore = createSem("threadLocal");                
+		spuStatus.mainSemaphore = m_mainSemaphore;
                 
                 checkPThreadFunction(pthread_create(&spuStatus.thread, NULL, &threadFunction, (void*)&spuStatus));
 
@@ -221,7 +220,7 @@ void PosixThreadSupport::startThreads(ThreadConstructionInfo& threadConstruction
 		spuStatus.m_userThreadFunc = threadConstructionInfo.m_userThreadFunc;
         spuStatus.threadUsed = 0;
 
-		printf("started thread %d \n",i);
+		//printf("started thread %d \n",i);
 		
 	}
 
@@ -235,23 +234,28 @@ void PosixThreadSupport::startSPU()
 ///tell the task scheduler we are done with the SPU tasks
 void PosixThreadSupport::stopSPU()
 {
+	// may be called both by the task process owning this and by the destructor
+	if (!m_mainSemaphore)
+		return;
+
 	for(size_t t=0; t < size_t(m_activeSpuStatus.size()); ++t) 
 	{
             btSpuStatus&	spuStatus = m_activeSpuStatus[t];
-            printf("%s: Thread %i used: %ld\n", __FUNCTION__, int(t), spuStatus.threadUsed);
+            //printf("%s: Thread %i used: %ld\n", __FUNCTION__, int(t), spuStatus.threadUsed);
 
 	spuStatus.m_userPtr = 0;       
  	checkPThreadFunction(sem_post(spuStatus.startSemaphore));
-	checkPThreadFunction(sem_wait(mainSemaphore));
+	checkPThreadFunction(sem_wait(m_mainSemaphore));
 
-	printf("destroy semaphore\n"); 
+	//printf("destroy semaphore\n"); 
             destroySem(spuStatus.startSemaphore);
-            printf("semaphore destroyed\n");
+            //printf("semaphore destroyed\n");
 		checkPThreadFunction(pthread_join(spuStatus.thread,0));
         }
-	printf("destroy main semaphore\n");
-        destroySem(mainSemaphore);
-	printf("main semaphore destroyed\n");
+	//printf("destroy main semaphore\n");
+        destroySem(m_mainSemaphore);
+	m_mainSemaphore = 0;
+	//printf("main semaphore destroyed\n");
 	m_activeSpuStatus.clear();
 }
 
@@ -61,12 +61,16 @@ public:
 
                 pthread_t thread;
                 sem_t* startSemaphore;
+                sem_t* mainSemaphore;
 
         unsigned long threadUsed;
 	};
 private:
 
 	btAlignedObjectArray<btSpuStatus>	m_activeSpuStatus;
+	// signals if and how many threads are finished with their work.
+	// one per instance, so that several PosixThreadSupports can coexist
+	sem_t* m_mainSemaphore;
 public:
 	///Setup and initialize SPU/CELL/Libspe2
 
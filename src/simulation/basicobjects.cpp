@@ -106,6 +106,7 @@ BulletObject::BulletObject(const BulletObject &o) : isKinematic(o.isKinematic) {
     // first copy over the collisionShape. This isn't a real deep copy,
     // but we can share collisionShapes so this should be fine
     collisionShape = o.collisionShape;
+    graphicsShape = o.graphicsShape;
 
     // then copy the motionstate
     motionState = o.motionState->clone(*this);
@@ -189,11 +190,16 @@ BulletObject::BulletObject(const BulletObject &o) : isKinematic(o.isKinematic) {
 
 
 void BulletConstraint::init() {
-    getEnvironment()->bullet->dynamicsWorld->addConstraint(cnt.get(), disableCollisionsBetweenLinkedBodies);
+    // through the pair filter, so the bodies don't even get a broadphase pair
+    getEnvironment()->bullet->dynamicsWorld->addConstraint(cnt.get());
+    if (disableCollisionsBetweenLinkedBodies)
+        getEnvironment()->bullet->disableCollision(&cnt->getRigidBodyA(), &cnt->getRigidBodyB());
 }
 
 void BulletConstraint::destroy() {
     getEnvironment()->bullet->dynamicsWorld->removeConstraint(cnt.get());
+    if (disableCollisionsBetweenLinkedBodies)
+        getEnvironment()->bullet->enableCollision(&cnt->getRigidBodyA(), &cnt->getRigidBodyB());
 }
 
 EnvironmentObject::Ptr BulletConstraint::copy(Fork &f) const {
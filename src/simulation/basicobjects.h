@@ -24,8 +24,10 @@ public:
 						//if (!obj.isKinematic) cout << "warning! called setKinematicPos on non-kinematic object." << endl;;
             btDefaultMotionState::setWorldTransform(pos);
             // if we want to do collision detection in between timesteps,
-            // we also have to directly set this
+            // we also have to directly set this, and refresh the broadphase AABB
             obj.rigidBody->setCenterOfMassTransform(pos);
+            if (obj.getEnvironment() && obj.rigidBody->getBroadphaseHandle())
+                obj.getEnvironment()->bullet->dynamicsWorld->updateSingleAabb(obj.rigidBody.get());
         }
 
         Ptr clone(BulletObject &newObj);
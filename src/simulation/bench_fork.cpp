@@ -0,0 +1,167 @@
+// Measures how long it takes to fork an Environment loaded from an OpenRAVE scene,
+// and how much memory each fork takes while it's alive. Also checks that a recycled Bullet world
+// steps exactly like a new one (exits with 1 if not), after timing forks of the scene with
+// more and more bodies added to it.
+// usage: bench_fork [scene.env.xml] [iterations]
+// (data/xml/multi_robot.env.xml is a scene with several robots)
+#include "environment.h"
+#include "openravesupport.h"
+#include "basicobjects.h"
+#include "logging.h"
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/format.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
+
+using namespace boost::posix_time;
+
+// resident set size of this process in kB (Linux only, 0 elsewhere)
+static long residentKB() {
+  std::ifstream statm("/proc/self/statm");
+  long size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// rigid bodies in the fork whose collision shape is the same object as the original's
+static int countSharedShapes(const Fork &f) {
+  int shared = 0;
+  BOOST_FOREACH(const Fork::ObjectMap::value_type &p, f.objMap) {
+    RaveObject *orig = dynamic_cast<RaveObject *>(p.first);
+    RaveObject::Ptr copy = boost::dynamic_pointer_cast<RaveObject>(p.second);
+    if (!orig || !copy) continue;
+    for (int i = 0; i < orig->getChildren().size(); ++i) {
+      if (orig->getChildren()[i]->collisionShape == copy->getChildren()[i]->collisionShape) ++shared;
+    }
+  }
+  return shared;
+}
+
+// drops a few spinning boxes on a ground plane in a new Environment on bullet and returns
+// their transforms after stepping. The step size isn't a multiple of the substep, so
+// the world keeps a substep remainder. dirty also changes world settings a user could change
+static std::vector<btTransform> dropBoxes(BulletInstance::Ptr bullet, bool dirty) {
+  Environment::Ptr env(new Environment(bullet));
+  btTransform groundTrans(btQuaternion::getIdentity(), btVector3(0, 0, -.5*METERS));
+  env->add(BulletObject::Ptr(new BoxObject(0, btVector3(5, 5, .5)*METERS, groundTrans)));
+  std::vector<BulletObject::Ptr> boxes;
+  for (int i = 0; i < 4; ++i) {
+    btTransform trans(btQuaternion(btVector3(1, 2, 3).normalized(), .3 + i), btVector3(.3*i, 0, .3 + .3*i)*METERS);
+    BulletObject::Ptr box(new BoxObject(1, btVector3(.4, .05, .1)*METERS, trans));
+    env->add(box);
+    box->rigidBody->setAngularVelocity(btVector3(3, -2, 5));
+    boxes.push_back(box);
+  }
+  if (dirty) {
+    bullet->dispatcher->setDispatcherFlags(bullet->dispatcher->getDispatcherFlags() & ~btCollisionDispatcher::CD_USE_RELATIVE_CONTACT_BREAKING_THRESHOLD);
+    bullet->dynamicsWorld->getSolverInfo().m_numIterations = 3;
+    bullet->softBodyWorldInfo->air_density = 0;
+    bullet->setGravity(btVector3(0, 0, 1));
+  }
+  for (int i = 0; i < 53; ++i) env->step(.013, 100, .01);
+  std::vector<btTransform> out;
+  BOOST_FOREACH(BulletObject::Ptr box, boxes) out.push_back(box->rigidBody->getCenterOfMassTransform());
+  return out;
+}
+
+// a recycled BulletInstance must step exactly like a new one
+static bool recycledStepsLikeNew() {
+  BulletInstancePool::Ptr pool(new BulletInstancePool());
+  BulletInstance *used;
+  {
+    BulletInstance::Ptr bullet = pool->acquire();
+    used = bullet.get();
+    dropBoxes(bullet, true);
+  }
+  BulletInstance::Ptr recycled = pool->acquire();
+  if (recycled.get() != used) throw std::runtime_error("recycledStepsLikeNew: the pool didn't recycle the instance");
+  std::vector<btTransform> a = dropBoxes(BulletInstance::Ptr(new BulletInstance()), false), b = dropBoxes(recycled, false);
+  for (int i = 0; i < a.size(); ++i)
+    if (memcmp(&a[i], &b[i], sizeof(btTransform)) != 0) return false;
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  LoggingInit();
+  string filename = argc > 1 ? argv[1] : "data/lab1.env.xml";
+  int iters = argc > 2 ? atoi(argv[2]) : 20;
+
+  RaveInstance::Ptr rave(new RaveInstance());
+  BulletInstance::Ptr bullet(new BulletInstance());
+  Environment::Ptr env(new Environment(bullet));
+  Load(env, rave, filename);
+
+  std::vector<KinBodyPtr> bodies;
+  rave->env->GetBodies(bodies);
+
+  ptime start = microsec_clock::local_time();
+  for (int i = 0; i < iters; ++i) {
+    Fork f(env, BulletInstance::Ptr(new BulletInstance()));
+  }
+  double elapsed = (microsec_clock::local_time() - start).total_microseconds() / 1e6;
+
+  // same, with recycled Bullet worlds
+  BulletInstancePool::Ptr pool(new BulletInstancePool());
+  start = microsec_clock::local_time();
+  for (int i = 0; i < iters; ++i) {
+    Fork f(env, pool->acquire());
+  }
+  double elapsedPooled = (microsec_clock::local_time() - start).total_microseconds() / 1e6;
+
+  // memory per fork, with all of them alive at once. Shapes and meshes are shared with
+  // the parent, so this should only grow with the dynamic state (bodies, constraints,
+  // the OpenRAVE clone)
+  std::vector<Fork::Ptr> forks;
+  long rssBefore = residentKB();
+  for (int i = 0; i < iters; ++i) {
+    forks.push_back(Fork::Ptr(new Fork(env, pool->acquire())));
+  }
+  long rssAfter = residentKB();
+  int bodiesPerFork = 0;
+  BOOST_FOREACH(EnvironmentObject::Ptr obj, env->objects) {
+    RaveObject::Ptr robj = boost::dynamic_pointer_cast<RaveObject>(obj);
+    if (robj) bodiesPerFork += robj->getChildren().size();
+  }
+
+  cout << filename << ": " << env->objects.size() << " objects, " << bodies.size() << " bodies" << endl;
+  cout << "fork: " << 1000. * elapsed / iters << " ms per fork (" << iters << " forks)" << endl;
+  cout << "fork with BulletInstancePool: " << 1000. * elapsedPooled / iters << " ms per fork" << endl;
+  cout << "memory: " << (rssAfter - rssBefore) / (double) iters << " kB per live fork ("
+       << rssBefore << " kB before forking); " << (forks.empty() ? 0 : countSharedShapes(*forks.front())) << " of "
+       << bodiesPerFork << " rigid bodies share their collision shape" << endl;
+  forks.clear();
+
+  // fork latency as the scene grows. Every fork clones the OpenRAVE environment once,
+  // however many RaveObjects it copies, so this should grow linearly with the scene
+  // rather than with objects x scene
+  cout << "objects\tbodies\tOpenRAVE clones per fork\tms per fork" << endl;
+  for (int added = 0; added <= 64; added = added ? 2*added : 8) {
+    for (int i = bodies.size(); i < added + (int) bodies.size(); ++i) {
+      string name = (boost::format("bench_mug_%d") % i).str();
+      if (rave->env->GetKinBody(name)) continue;
+      KinBodyPtr mug = rave->env->ReadKinBodyURI("data/mug1.kinbody.xml");
+      mug->SetName(name);
+      rave->env->AddKinBody(mug);
+      OpenRAVE::Transform t;
+      t.trans = OpenRAVE::Vector(2 + .2*(i % 8), .2*(i / 8), 0);
+      mug->SetTransform(t);
+      LoadFromRaveSingle(env, rave, mug, true, false);
+    }
+    std::vector<KinBodyPtr> sceneBodies;
+    rave->env->GetBodies(sceneBodies);
+    int clones = 0;
+    start = microsec_clock::local_time();
+    for (int i = 0; i < iters; ++i) {
+      Fork f(env, pool->acquire());
+      clones = f.raveCopies.size();
+    }
+    double elapsedSweep = (microsec_clock::local_time() - start).total_microseconds() / 1e6;
+    cout << env->objects.size() << "\t" << sceneBodies.size() << "\t" << clones << "\t" << 1000. * elapsedSweep / iters << endl;
+  }
+
+  bool same = recycledStepsLikeNew();
+  cout << "recycled Bullet world steps " << (same ? "like" : "DIFFERENTLY from") << " a new one" << endl;
+  return same ? 0 : 1;
+}
@@ -2,6 +2,13 @@
 #include "logging.h"
 
 #include "rope.h"
+#include <boost/bind.hpp>
+#include <boost/math/special_functions/fpclassify.hpp>
+#include <numpy/arrayobject.h>
+
+#ifndef NPY_ARRAY_IN_ARRAY // numpy < 1.7
+#define NPY_ARRAY_IN_ARRAY NPY_IN_ARRAY
+#endif
 
 namespace bs {
 
@@ -11,6 +18,9 @@ static SimulationParamsPtr g_simparams;
 void InitPython() {
   openravepy = py::import("openravepy");
   numpy = py::import("numpy");
+  if (_import_array() < 0) {
+    py::throw_error_already_set();
+  }
 }
 
 SimulationParamsPtr GetSimParams() {
@@ -39,47 +49,81 @@ string toStr(const btVector3 &v) {
   return ss.str();
 }
 
+// numpy arrays are created and read through the NumPy C API (imported in InitPython),
+// so none of these go through python attribute lookups.
+// The toNdarray functions take an optional output array: if given, it must be a
+// C-contiguous, writeable array of the right type and shape, and it's filled and returned
+// instead of allocating a new one.
 template<typename T>
 struct type_traits {
-  static const char* npname;
+  static const int nptype;
 };
-template<> const char* type_traits<float>::npname = "float32";
-template<> const char* type_traits<int>::npname = "int32";
-template<> const char* type_traits<double>::npname = "float64";
+template<> const int type_traits<float>::nptype = NPY_FLOAT32;
+template<> const int type_traits<int>::nptype = NPY_INT32;
+template<> const int type_traits<double>::nptype = NPY_FLOAT64;
+template<> const int type_traits<unsigned long>::nptype = NPY_ULONG;
+template<> const int type_traits<npy_bool>::nptype = NPY_BOOL;
 
 template <typename T>
 T* getPointer(const py::object& arr) {
-  long int i = py::extract<long int>(arr.attr("ctypes").attr("data"));
-  T* p = (T*)i;
-  return p;
+  return (T*) PyArray_DATA((PyArrayObject*) arr.ptr());
+}
+
+template<typename T>
+py::object newNdarray(int nd, npy_intp* dims) {
+  PyObject* arr = PyArray_SimpleNew(nd, dims, type_traits<T>::nptype);
+  if (!arr) py::throw_error_already_set();
+  return py::object(py::handle<>(arr));
 }
 
 template<typename T>
-py::object toNdarray1(const T* data, size_t dim0) {
-  py::object out = numpy.attr("empty")(py::make_tuple(dim0), type_traits<T>::npname);
-  T* p = getPointer<T>(out);
-  memcpy(p, data, dim0*sizeof(T));
+py::object outNdarray(py::object out, int nd, npy_intp* dims) {
+  if (out.ptr() == Py_None) {
+    return newNdarray<T>(nd, dims);
+  }
+  if (!PyArray_Check(out.ptr())) {
+    throw std::runtime_error("expected output array to be a numpy array");
+  }
+  PyArrayObject* a = (PyArrayObject*) out.ptr();
+  if (PyArray_TYPE(a) != type_traits<T>::nptype) {
+    throw std::runtime_error((boost::format("expected output array of type %s") % PyArray_DescrFromType(type_traits<T>::nptype)->typeobj->tp_name).str());
+  }
+  if (!PyArray_ISCARRAY(a)) {
+    throw std::runtime_error("expected output array to be C-contiguous, aligned and writeable");
+  }
+  if (PyArray_NDIM(a) != nd || !PyArray_CompareLists(PyArray_DIMS(a), dims, nd)) {
+    throw std::runtime_error((boost::format("output array has wrong shape (expected %d-d, first dim %d)") % nd % dims[0]).str());
+  }
   return out;
 }
+
 template<typename T>
-py::object toNdarray2(const T* data, size_t dim0, size_t dim1) {
-  py::object out = numpy.attr("empty")(py::make_tuple(dim0, dim1), type_traits<T>::npname);
-  T* pout = getPointer<T>(out);
-  memcpy(pout, data, dim0*dim1*sizeof(T));
+py::object toNdarray1(const T* data, size_t dim0, py::object out=py::object()) {
+  npy_intp dims[] = {(npy_intp) dim0};
+  out = outNdarray<T>(out, 1, dims);
+  memcpy(getPointer<T>(out), data, dim0*sizeof(T));
+  return out;
+}
+template<typename T>
+py::object toNdarray2(const T* data, size_t dim0, size_t dim1, py::object out=py::object()) {
+  npy_intp dims[] = {(npy_intp) dim0, (npy_intp) dim1};
+  out = outNdarray<T>(out, 2, dims);
+  memcpy(getPointer<T>(out), data, dim0*dim1*sizeof(T));
   return out;
 }
 
-py::object toNdarray(const btVector3 &v) {
-  return toNdarray1(v.m_floats, 3); // TODO: check float vs double
+py::object toNdarray(const btVector3 &v, py::object out=py::object()) {
+  return toNdarray1(v.m_floats, 3, out); // TODO: check float vs double
 }
 
 template<typename T>
-py::object toNdarray(const vector<T> &v) {
-  return toNdarray1<T>(v.data(), v.size());
+py::object toNdarray(const vector<T> &v, py::object out=py::object()) {
+  return toNdarray1<T>(v.data(), v.size(), out);
 }
 
-py::object toNdarray2(const vector<btVector3> &vs) {
-  py::object out = numpy.attr("empty")(py::make_tuple(vs.size(), 3), type_traits<btScalar>::npname);
+py::object toNdarray2(const vector<btVector3> &vs, py::object out=py::object()) {
+  npy_intp dims[] = {(npy_intp) vs.size(), 3};
+  out = outNdarray<btScalar>(out, 2, dims);
   btScalar* pout = getPointer<btScalar>(out);
   for (int i = 0; i < vs.size(); ++i) {
     for (int j = 0; j < 3; ++j) {
@@ -89,8 +133,9 @@ py::object toNdarray2(const vector<btVector3> &vs) {
   return out;
 }
 
-py::object toNdarray3(const vector<btMatrix3x3> &v) {
-  py::object out = numpy.attr("empty")(py::make_tuple(v.size(), 3, 3), type_traits<btScalar>::npname);
+py::object toNdarray3(const vector<btMatrix3x3> &v, py::object out=py::object()) {
+  npy_intp dims[] = {(npy_intp) v.size(), 3, 3};
+  out = outNdarray<btScalar>(out, 3, dims);
   btScalar* pout = getPointer<btScalar>(out);
   for (int i = 0; i < v.size(); ++i) {
     for (int j = 0; j < 3; ++j) {
@@ -102,52 +147,75 @@ py::object toNdarray3(const vector<btMatrix3x3> &v) {
   return out;
 }
 
-py::object toNdarray3(const vector<btTransform> &v) {
-  py::object out = numpy.attr("empty")(py::make_tuple(v.size(), 3, 3), type_traits<btScalar>::npname);
+// writes t as a row-major homogeneous 4x4 matrix
+static void writeTransform(const btTransform &t, btScalar* pout) {
+  for (int j = 0; j < 3; ++j) {
+    for (int k = 0; k < 3; ++k) {
+      pout[4*j + k] = t.getBasis().getRow(j).m_floats[k];
+    }
+    pout[4*j + 3] = t.getOrigin().m_floats[j];
+  }
+  pout[12] = pout[13] = pout[14] = 0;
+  pout[15] = 1;
+}
+
+// homogeneous 4x4 matrix
+py::object toNdarray2(const btTransform &t, py::object out=py::object()) {
+  npy_intp dims[] = {4, 4};
+  out = outNdarray<btScalar>(out, 2, dims);
+  writeTransform(t, getPointer<btScalar>(out));
+  return out;
+}
+
+// homogeneous 4x4 matrices
+py::object toNdarray3(const vector<btTransform> &v, py::object out=py::object()) {
+  npy_intp dims[] = {(npy_intp) v.size(), 4, 4};
+  out = outNdarray<btScalar>(out, 3, dims);
   btScalar* pout = getPointer<btScalar>(out);
   for (int i = 0; i < v.size(); ++i) {
     for (int j = 0; j < 3; ++j) {
       for (int k = 0; k < 3; ++k) {
-        *(pout + 9*i + 3*j + k) = v[i].getBasis().getRow(j).m_floats[k];
+        *(pout + 16*i + 4*j + k) = v[i].getBasis().getRow(j).m_floats[k];
       }
-    }
-    for (int j = 0; j < 3; ++j) {
-      *(pout + 9*i + 3*j + 3) = v[i].getOrigin().m_floats[j];
+      *(pout + 16*i + 4*j + 3) = v[i].getOrigin().m_floats[j];
     }
     for (int k = 0; k < 3; ++k) {
-      *(pout + 9*i + 3*3 + k) = 0.0;
+      *(pout + 16*i + 4*3 + k) = 0.0;
     }
-    *(pout + 9*i + 3*3 + 3) = 1.0;
+    *(pout + 16*i + 4*3 + 3) = 1.0;
   }
   return out;
 }
 
 template<typename T>
 py::object ensureFormat(py::object ndarray) {
-  // ensure C-order and data type, possibly making a new ndarray
-  return numpy.attr("ascontiguousarray")(ndarray, type_traits<T>::npname);
+  // ensure C-order and data type, possibly making a new ndarray (no copy if it's already fine)
+  // (any input type is cast, like ascontiguousarray(a, dtype) would)
+  PyObject* arr = PyArray_FROMANY(ndarray.ptr(), type_traits<T>::nptype, 0, 0, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST);
+  if (!arr) py::throw_error_already_set();
+  return py::object(py::handle<>(arr));
 }
 
 template<typename T>
 void fromNdarray2(py::object a, vector<T> &out, size_t &out_dim0, size_t &out_dim1) {
   a = ensureFormat<T>(a);
-  py::object shape = a.attr("shape");
-  if (py::len(shape) != 2) {
-    throw std::runtime_error((boost::format("expected 2-d array, got %d-d instead") % py::len(shape)).str());
+  PyArrayObject* arr = (PyArrayObject*) a.ptr();
+  if (PyArray_NDIM(arr) != 2) {
+    throw std::runtime_error((boost::format("expected 2-d array, got %d-d instead") % PyArray_NDIM(arr)).str());
   }
-  out_dim0 = py::extract<size_t>(shape[0]);
-  out_dim1 = py::extract<size_t>(shape[1]);
+  out_dim0 = PyArray_DIM(arr, 0);
+  out_dim1 = PyArray_DIM(arr, 1);
   out.resize(out_dim0 * out_dim1);
   memcpy(out.data(), getPointer<T>(a), out_dim0*out_dim1*sizeof(T));
 }
 
 btVector3 fromNdarray1ToBtVec3(py::object a) {
   a = ensureFormat<btScalar>(a);
-  py::object shape = a.attr("shape");
-  if (py::len(shape) != 1) {
-    throw std::runtime_error((boost::format("expected 1-d array, got %d-d instead") % py::len(shape)).str());
+  PyArrayObject* arr = (PyArrayObject*) a.ptr();
+  if (PyArray_NDIM(arr) != 1) {
+    throw std::runtime_error((boost::format("expected 1-d array, got %d-d instead") % PyArray_NDIM(arr)).str());
   }
-  size_t out_dim0 = py::extract<size_t>(shape[0]);
+  size_t out_dim0 = PyArray_DIM(arr, 0);
   if (out_dim0 != 3) {
     throw std::runtime_error((boost::format("expected shape[0] == 3, got %d instead") % out_dim0).str());
   }
@@ -158,12 +226,12 @@ btVector3 fromNdarray1ToBtVec3(py::object a) {
 
 void fromNdarray2ToBtVecs(py::object a, vector<btVector3> &out) {
   a = ensureFormat<btScalar>(a);
-  py::object shape = a.attr("shape");
-  if (py::len(shape) != 2) {
-    throw std::runtime_error((boost::format("expected 2-d array, got %d-d instead") % py::len(shape)).str());
+  PyArrayObject* arr = (PyArrayObject*) a.ptr();
+  if (PyArray_NDIM(arr) != 2) {
+    throw std::runtime_error((boost::format("expected 2-d array, got %d-d instead") % PyArray_NDIM(arr)).str());
   }
-  size_t out_dim0 = py::extract<size_t>(shape[0]);
-  size_t out_dim1 = py::extract<size_t>(shape[1]);
+  size_t out_dim0 = PyArray_DIM(arr, 0);
+  size_t out_dim1 = PyArray_DIM(arr, 1);
   if (out_dim1 != 3) {
     throw std::runtime_error((boost::format("expected shape[1] == 3, got %d instead") % out_dim1).str());
   }
@@ -171,21 +239,19 @@ void fromNdarray2ToBtVecs(py::object a, vector<btVector3> &out) {
   btScalar* pin = getPointer<btScalar>(a);
   out.resize(out_dim0);
   for (int i = 0; i < out_dim0; ++i) {
-    for (int j = 0; j < 3; ++j) {
-      out[i].m_floats[j] = *(pin + 3*i + j);
-    }
+    out[i].setValue(*(pin + 3*i), *(pin + 3*i + 1), *(pin + 3*i + 2));
   }
 }
 
 void fromNdarray3ToBtMats(py::object a, vector<btMatrix3x3> &out) {
   a = ensureFormat<btScalar>(a);
-  py::object shape = a.attr("shape");
-  if (py::len(shape) != 3) {
-    throw std::runtime_error((boost::format("expected 3-d array, got %d-d instead") % py::len(shape)).str());
+  PyArrayObject* arr = (PyArrayObject*) a.ptr();
+  if (PyArray_NDIM(arr) != 3) {
+    throw std::runtime_error((boost::format("expected 3-d array, got %d-d instead") % PyArray_NDIM(arr)).str());
   }
-  size_t out_dim0 = py::extract<size_t>(shape[0]);
-  size_t out_dim1 = py::extract<size_t>(shape[1]);
-  size_t out_dim2 = py::extract<size_t>(shape[2]);
+  size_t out_dim0 = PyArray_DIM(arr, 0);
+  size_t out_dim1 = PyArray_DIM(arr, 1);
+  size_t out_dim2 = PyArray_DIM(arr, 2);
   if (out_dim1 != 3) {
     throw std::runtime_error((boost::format("expected shape[1] == 3, got %d instead") % out_dim1).str());
   }
@@ -216,16 +282,37 @@ btVector3 toBtVector3(py::object v) {
   return fromNdarray1ToBtVec3(v);
 }
 
+// reads a row-major homogeneous 4x4 matrix
+static btTransform readTransform(const btScalar* hmat, btScalar scale=1) {
+  btTransform t(btMatrix3x3(hmat[0], hmat[1], hmat[2],
+                            hmat[4], hmat[5], hmat[6],
+                            hmat[8], hmat[9], hmat[10]),
+                btVector3(hmat[3], hmat[7], hmat[11]));
+  t.getOrigin() *= scale;
+  return t;
+}
+
 btTransform toBtTransform(py::object py_hmat, btScalar scale=1) {
   vector<btScalar> hmat; size_t dim0, dim1;
-  fromNdarray2(py_hmat.attr("T"), hmat, dim0, dim1);
+  fromNdarray2(py_hmat, hmat, dim0, dim1);
   if (dim0 != 4 || dim1 != 4) {
     throw std::runtime_error((boost::format("expected 4x4 matrix, got %dx%d") % dim0 % dim1).str());
   }
-  btTransform t;
-  t.setFromOpenGLMatrix(hmat.data());
-  t.getOrigin() *= scale;
-  return t;
+  return readTransform(hmat.data(), scale);
+}
+
+// a as a C-contiguous array of T with the given shape (copied only if it isn't one already)
+template<typename T>
+py::object ensureShape(py::object a, int nd, npy_intp* dims) {
+  a = ensureFormat<T>(a);
+  PyArrayObject* arr = (PyArrayObject*) a.ptr();
+  if (PyArray_NDIM(arr) != nd || !PyArray_CompareLists(PyArray_DIMS(arr), dims, nd)) {
+    stringstream expected, got;
+    for (int i = 0; i < nd; ++i) expected << (i ? "x" : "") << dims[i];
+    for (int i = 0; i < PyArray_NDIM(arr); ++i) got << (i ? "x" : "") << PyArray_DIM(arr, i);
+    throw std::runtime_error((boost::format("expected array of shape %s, got %s") % expected.str() % got.str()).str());
+  }
+  return a;
 }
 
 template<typename KeyT, typename ValueT>
@@ -274,10 +361,8 @@ py::object BulletObject::py_GetKinBody() { return GetPyKinBody(m_obj->body); }
 btTransform BulletObject::GetTransform() {
   return m_obj->toRaveFrame(m_obj->children[0]->rigidBody->getCenterOfMassTransform());
 }
-py::object BulletObject::py_GetTransform() {
-  btScalar mat[16];
-  GetTransform().getOpenGLMatrix(mat);
-  return toNdarray2(mat, 4, 4).attr("T");
+py::object BulletObject::py_GetTransform(py::object out) {
+  return toNdarray2(GetTransform(), out);
 }
 
 void BulletObject::SetTransform(const btTransform& t) {
@@ -288,6 +373,37 @@ void BulletObject::py_SetTransform(py::object py_hmat) {
   SetTransform(toBtTransform(py_hmat, 1));
 }
 
+static int countLeafShapes(const btCollisionShape *shape) {
+  if (!shape->isCompound()) return 1;
+  const btCompoundShape *compound = static_cast<const btCompoundShape *>(shape);
+  int n = 0;
+  for (int i = 0; i < compound->getNumChildShapes(); ++i) n += countLeafShapes(compound->getChildShape(i));
+  return n;
+}
+
+int BulletObject::GetNumCollisionShapes() {
+  int n = 0;
+  RaveObject::ChildVector &children = m_obj->getChildren();
+  for (int i = 0; i < children.size(); ++i) {
+    if (children[i]) n += countLeafShapes(children[i]->rigidBody->getCollisionShape());
+  }
+  return n;
+}
+
+btVector3 BulletObject::GetLinearVelocity() {
+  return m_obj->children[0]->rigidBody->getLinearVelocity() / METERS;
+}
+py::object BulletObject::py_GetLinearVelocity() {
+  return toNdarray(GetLinearVelocity());
+}
+
+btVector3 BulletObject::GetAngularVelocity() {
+  return m_obj->children[0]->rigidBody->getAngularVelocity() / METERS;
+}
+py::object BulletObject::py_GetAngularVelocity() {
+  return toNdarray(GetAngularVelocity());
+}
+
 void BulletObject::SetLinearVelocity(const btVector3& v) {
   m_obj->children[0]->rigidBody->setLinearVelocity(v * METERS);
 }
@@ -310,6 +426,10 @@ void BulletObject::UpdateRave() {
   m_obj->updateRave();
 }
 
+int BulletObject::DisableNeverCollidingLinks(int samples) {
+  return m_obj->disableNeverCollidingLinks(samples);
+}
+
 
 Collision::Collision(const KinBody::LinkPtr linkA_, const KinBody::LinkPtr linkB_, const btVector3& ptA_, const btVector3& ptB_, const btVector3& normalB2A_, double distance_, double weight_) :
   linkA(linkA_),
@@ -341,7 +461,17 @@ SimulationParams::SimulationParams()
     friction(.5),
     restitution(0),
     margin(.0005),
-    linkPadding(0)
+    linkPadding(0),
+    numThreads(1),
+    solverType(0),
+    manifoldPoolSize(16384),
+    shapeCacheDir(""),
+    trimeshMode(0),
+    hacdMinClusters(2),
+    hacdMaxVerticesPerHull(100),
+    hacdConcavity(100),
+    loadThreads(0),
+    checkThreads(0)
 { }
 
 void SimulationParams::Apply() {
@@ -354,6 +484,15 @@ void SimulationParams::Apply() {
   BulletConfig::restitution = restitution;
   BulletConfig::margin = margin;
   BulletConfig::linkPadding = linkPadding;
+  BulletConfig::numThreads = numThreads;
+  BulletConfig::solverType = solverType;
+  BulletConfig::manifoldPoolSize = manifoldPoolSize;
+  BulletConfig::shapeCacheDir = shapeCacheDir;
+  BulletConfig::trimeshMode = trimeshMode;
+  BulletConfig::hacdMinClusters = hacdMinClusters;
+  BulletConfig::hacdMaxVerticesPerHull = hacdMaxVerticesPerHull;
+  BulletConfig::hacdConcavity = hacdConcavity;
+  BulletConfig::loadThreads = loadThreads;
 }
 
 void BulletEnvironment::init(EnvironmentBasePtr rave_env, const vector<string>& dynamic_obj_names) {
@@ -378,28 +517,40 @@ BulletEnvironment::~BulletEnvironment() {
   LOG_DEBUG("py bullet env destroyed");
 }
 
+BulletObjectPtr BulletEnvironment::wrap(RaveObject::Ptr obj) {
+  if (!obj) {
+    return BulletObjectPtr(new BulletObject(obj));
+  }
+  // the cached wrapper keeps obj alive, so its address can't be reused by another object
+  BulletObjectPtr &wrapper = m_wrappers[obj.get()];
+  if (!wrapper) {
+    wrapper.reset(new BulletObject(obj));
+  }
+  return wrapper;
+}
+
 BulletObjectPtr BulletEnvironment::GetObjectByName(const string &name) {
-  return BulletObjectPtr(new BulletObject(getObjectByName(m_env, m_rave, name)));
+  return wrap(getObjectByName(m_env, m_rave, name));
 }
 
 BulletObjectPtr BulletEnvironment::GetObjectFromKinBody(KinBodyPtr kb) {
   if (RaveGetEnvironmentId(kb->GetEnv()) != RaveGetEnvironmentId(m_rave->env)) {
     throw std::runtime_error("trying to get Bullet object for a KinBody that doesn't belong to this (OpenRAVE base) environment");
   }
-  return BulletObjectPtr(new BulletObject(getObjectByName(m_env, m_rave, kb->GetName())));
+  return wrap(getObjectByKinBody(m_env, m_rave, kb));
 }
 BulletObjectPtr BulletEnvironment::py_GetObjectFromKinBody(py::object py_kb) {
   if (openravepy.attr("RaveGetEnvironmentId")(py_kb.attr("GetEnv")()) != RaveGetEnvironmentId(m_rave->env)) {
     throw std::runtime_error("trying to get Bullet object for a KinBody that doesn't belong to this (OpenRAVE base) environment");
   }
-  return BulletObjectPtr(new BulletObject(getObjectByName(m_env, m_rave, GetCppKinBody(py_kb, m_rave->env)->GetName())));
+  return wrap(getObjectByKinBody(m_env, m_rave, GetCppKinBody(py_kb, m_rave->env)));
 }
 
 vector<BulletObjectPtr> BulletEnvironment::GetObjects() {
   vector<KinBodyPtr> bodies; m_rave->env->GetBodies(bodies);
   vector<BulletObjectPtr> out; out.reserve(bodies.size());
   BOOST_FOREACH(const KinBodyPtr& body, bodies) {
-    out.push_back(GetObjectByName(body->GetName()));
+    out.push_back(wrap(getObjectByKinBody(m_env, m_rave, body)));
   }
   return out;
 }
@@ -431,6 +582,56 @@ RaveInstance::Ptr BulletEnvironment::GetRaveInstance() {
 void BulletEnvironment::SetGravity(const btVector3& g) {
   m_env->bullet->setGravity(g);
 }
+void CollisionBatch::Clear() {
+  ptA.clear(); ptB.clear(); normalB2A.clear();
+  distance.clear(); weight.clear();
+  bodyA.clear(); linkA.clear(); bodyB.clear(); linkB.clear();
+}
+
+void CollisionBatch::Reserve(int n) {
+  ptA.reserve(3*n); ptB.reserve(3*n); normalB2A.reserve(3*n);
+  distance.reserve(n); weight.reserve(n);
+  bodyA.reserve(n); linkA.reserve(n); bodyB.reserve(n); linkB.reserve(n);
+}
+
+static void appendVec(vector<btScalar> &v, const btVector3 &x) {
+  v.push_back(x.x()); v.push_back(x.y()); v.push_back(x.z());
+}
+
+void CollisionBatch::Add(const KinBody::Link &a, const KinBody::Link &b, const btManifoldPoint &pt, double weight_) {
+  appendVec(ptA, pt.getPositionWorldOnA()/METERS);
+  appendVec(ptB, pt.getPositionWorldOnB()/METERS);
+  appendVec(normalB2A, pt.m_normalWorldOnB/METERS);
+  distance.push_back(pt.m_distance1/METERS);
+  weight.push_back(weight_);
+  bodyA.push_back(a.GetParent()->GetEnvironmentId());
+  linkA.push_back(a.GetIndex());
+  bodyB.push_back(b.GetParent()->GetEnvironmentId());
+  linkB.push_back(b.GetIndex());
+}
+
+void CollisionBatch::Add(const KinBody::Link &a, const KinBody::Link &b, const DistanceResult &r) {
+  appendVec(ptA, r.ptA/METERS);
+  appendVec(ptB, r.ptB/METERS);
+  appendVec(normalB2A, r.normalB2A/METERS); // same as the manifold points
+  distance.push_back(r.distance/METERS);
+  weight.push_back(1.);
+  bodyA.push_back(a.GetParent()->GetEnvironmentId());
+  linkA.push_back(a.GetIndex());
+  bodyB.push_back(b.GetParent()->GetEnvironmentId());
+  linkB.push_back(b.GetIndex());
+}
+
+py::object CollisionBatch::py_ptA() { return toNdarray2(ptA.data(), Size(), 3); }
+py::object CollisionBatch::py_ptB() { return toNdarray2(ptB.data(), Size(), 3); }
+py::object CollisionBatch::py_normalB2A() { return toNdarray2(normalB2A.data(), Size(), 3); }
+py::object CollisionBatch::py_distance() { return toNdarray(distance); }
+py::object CollisionBatch::py_weight() { return toNdarray(weight); }
+py::object CollisionBatch::py_bodyA() { return toNdarray(bodyA); }
+py::object CollisionBatch::py_linkA() { return toNdarray(linkA); }
+py::object CollisionBatch::py_bodyB() { return toNdarray(bodyB); }
+py::object CollisionBatch::py_linkB() { return toNdarray(linkB); }
+
 void BulletEnvironment::py_SetGravity(py::list g) {
   SetGravity(toBtVector3(g));
 }
@@ -442,10 +643,239 @@ py::object BulletEnvironment::py_GetGravity() {
   return toNdarray(GetGravity());
 }
 
+int BulletEnvironment::SyncToRave(float threshold) {
+  EnvironmentMutex::scoped_lock lock(m_rave->env->GetMutex());
+  int n = 0;
+  BOOST_FOREACH(EnvironmentObject::Ptr obj, m_env->objects) {
+    RaveObject* robj = dynamic_cast<RaveObject*>(obj.get());
+    if (robj && !robj->getIsKinematic() && robj->updateRaveIfMoved(threshold)) ++n;
+  }
+  return n;
+}
+
+int BulletEnvironment::SyncFromRave() {
+  EnvironmentMutex::scoped_lock lock(m_rave->env->GetMutex());
+  int n = 0;
+  BOOST_FOREACH(EnvironmentObject::Ptr obj, m_env->objects) {
+    RaveObject* robj = dynamic_cast<RaveObject*>(obj.get());
+    if (robj && robj->getIsKinematic() && robj->updateBulletIfChanged()) ++n;
+  }
+  return n;
+}
+
 void BulletEnvironment::Step(float dt, int maxSubSteps, float fixedTimeStep) {
   m_env->step(dt, maxSubSteps, fixedTimeStep);
 }
 
+static void addBodies(RaveObject &obj, vector<const btCollisionObject*> &out) {
+  RaveObject::ChildVector& children = obj.getChildren();
+  for (int i = 0; i < children.size(); ++i) {
+    if (children[i]) out.push_back(children[i]->rigidBody.get());
+  }
+}
+
+int BulletEnvironment::StepN(int n, float dt, int maxSubSteps, float fixedTimeStep,
+                             const vector<BulletObjectPtr>& objs, btScalar* transforms,
+                             const vector<CapsuleRopePtr>& ropes, btScalar* nodes, int stopOn) {
+  int numNodes = 0;
+  for (int j = 0; j < ropes.size(); ++j) {
+    numNodes += ropes[j]->GetNodes().size();
+  }
+  int transformsSize = 16*objs.size(), nodesSize = 3*numNodes;
+  // rows go to a scratch buffer when they aren't recorded but still have to be checked for NaNs
+  vector<btScalar> scratch;
+  if ((stopOn & STOP_ON_NAN) && (!transforms || !nodes)) {
+    scratch.resize(transformsSize + nodesSize);
+  }
+
+  // bodies of the recorded objects, sorted for STOP_ON_CONTACT
+  vector<const btCollisionObject*> bodies;
+  if (stopOn & STOP_ON_CONTACT) {
+    for (int j = 0; j < objs.size(); ++j) {
+      addBodies(*objs[j]->m_obj, bodies);
+    }
+    for (int j = 0; j < ropes.size(); ++j) {
+      addBodies(*ropes[j]->m_obj, bodies);
+    }
+    std::sort(bodies.begin(), bodies.end());
+  }
+
+  for (int i = 0; i < n; ++i) {
+    Step(dt, maxSubSteps, fixedTimeStep);
+
+    btScalar* trow = transforms ? transforms + i*transformsSize : (scratch.empty() ? NULL : &scratch[0]);
+    btScalar* nrow = nodes ? nodes + i*nodesSize : (scratch.empty() ? NULL : &scratch[transformsSize]);
+    if (trow) {
+      for (int j = 0; j < objs.size(); ++j) {
+        writeTransform(objs[j]->GetTransform(), trow + 16*j);
+      }
+    }
+    if (nrow) {
+      btScalar* p = nrow;
+      for (int j = 0; j < ropes.size(); ++j) {
+        vector<btVector3> ropeNodes = ropes[j]->GetNodes();
+        for (int k = 0; k < ropeNodes.size(); ++k, p += 3) {
+          p[0] = ropeNodes[k].x(); p[1] = ropeNodes[k].y(); p[2] = ropeNodes[k].z();
+        }
+      }
+    }
+
+    if (stopOn & STOP_ON_NAN) {
+      for (int k = 0; k < transformsSize; ++k) {
+        if (!boost::math::isfinite(trow[k])) return i+1;
+      }
+      for (int k = 0; k < nodesSize; ++k) {
+        if (!boost::math::isfinite(nrow[k])) return i+1;
+      }
+    }
+    if ((stopOn & STOP_ON_CONTACT) && !bodies.empty()) {
+      btCollisionDispatcher *dispatcher = m_env->bullet->dispatcher;
+      for (int m = 0; m < dispatcher->getNumManifolds(); ++m) {
+        btPersistentManifold* manifold = dispatcher->getManifoldByIndexInternal(m);
+        if (!std::binary_search(bodies.begin(), bodies.end(), manifold->getBody0()) &&
+            !std::binary_search(bodies.begin(), bodies.end(), manifold->getBody1())) continue;
+        for (int k = 0; k < manifold->getNumContacts(); ++k) {
+          if (manifold->getContactPoint(k).getDistance() < 0) return i+1;
+        }
+      }
+    }
+  }
+  return n;
+}
+
+static vector<BulletObjectPtr> toBulletObjectVec(py::object py_objs) {
+  vector<BulletObjectPtr> out;
+  int n = py::len(py_objs);
+  out.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    out.push_back(py::extract<BulletObjectPtr>(py_objs[i]));
+  }
+  return out;
+}
+
+vector<BulletObjectPtr> BulletEnvironment::toObjects(py::object py_objs) {
+  return py_objs.ptr() == Py_None ? GetDynamicObjects() : toBulletObjectVec(py_objs);
+}
+
+py::object BulletEnvironment::py_GetTransforms(py::object py_objs, py::object out) {
+  vector<BulletObjectPtr> objs = toObjects(py_objs);
+  npy_intp dims[] = {(npy_intp) objs.size(), 4, 4};
+  out = outNdarray<btScalar>(out, 3, dims);
+  btScalar* pout = getPointer<btScalar>(out);
+  for (int i = 0; i < objs.size(); ++i) {
+    writeTransform(objs[i]->GetTransform(), pout + 16*i);
+  }
+  return out;
+}
+
+void BulletEnvironment::py_SetTransforms(py::object py_objs, py::object transforms) {
+  vector<BulletObjectPtr> objs = toObjects(py_objs);
+  npy_intp dims[] = {(npy_intp) objs.size(), 4, 4};
+  transforms = ensureShape<btScalar>(transforms, 3, dims);
+  const btScalar* pin = getPointer<btScalar>(transforms);
+  for (int i = 0; i < objs.size(); ++i) {
+    objs[i]->SetTransform(readTransform(pin + 16*i));
+  }
+}
+
+static py::object getVectors(const vector<BulletObjectPtr>& objs, btVector3 (BulletObject::*get)(), py::object out) {
+  npy_intp dims[] = {(npy_intp) objs.size(), 3};
+  out = outNdarray<btScalar>(out, 2, dims);
+  btScalar* pout = getPointer<btScalar>(out);
+  for (int i = 0; i < objs.size(); ++i) {
+    btVector3 v = (objs[i].get()->*get)();
+    pout[3*i] = v.x(); pout[3*i+1] = v.y(); pout[3*i+2] = v.z();
+  }
+  return out;
+}
+
+static void setVectors(const vector<BulletObjectPtr>& objs, void (BulletObject::*set)(const btVector3&), py::object vs) {
+  npy_intp dims[] = {(npy_intp) objs.size(), 3};
+  vs = ensureShape<btScalar>(vs, 2, dims);
+  const btScalar* pin = getPointer<btScalar>(vs);
+  for (int i = 0; i < objs.size(); ++i) {
+    (objs[i].get()->*set)(btVector3(pin[3*i], pin[3*i+1], pin[3*i+2]));
+  }
+}
+
+py::object BulletEnvironment::py_GetLinearVelocities(py::object py_objs, py::object out) {
+  return getVectors(toObjects(py_objs), &BulletObject::GetLinearVelocity, out);
+}
+void BulletEnvironment::py_SetLinearVelocities(py::object py_objs, py::object v) {
+  setVectors(toObjects(py_objs), &BulletObject::SetLinearVelocity, v);
+}
+py::object BulletEnvironment::py_GetAngularVelocities(py::object py_objs, py::object out) {
+  return getVectors(toObjects(py_objs), &BulletObject::GetAngularVelocity, out);
+}
+void BulletEnvironment::py_SetAngularVelocities(py::object py_objs, py::object w) {
+  setVectors(toObjects(py_objs), &BulletObject::SetAngularVelocity, w);
+}
+
+py::tuple BulletEnvironment::py_StepN(int n, float dt, int maxSubSteps, float fixedTimeStep,
+                                      py::list py_objs, py::list py_ropes,
+                                      py::object transforms_out, py::object nodes_out, int stopOn) {
+  if (n < 0) {
+    throw std::runtime_error((boost::format("StepN: number of steps must be non-negative, got %d") % n).str());
+  }
+  vector<BulletObjectPtr> objs = toBulletObjectVec(py_objs);
+  vector<CapsuleRopePtr> ropes;
+  int numNodes = 0;
+  for (int i = 0; i < py::len(py_ropes); ++i) {
+    ropes.push_back(py::extract<CapsuleRopePtr>(py_ropes[i]));
+    numNodes += ropes.back()->GetNodes().size();
+  }
+
+  npy_intp tdims[] = {n, (npy_intp) objs.size(), 4, 4};
+  transforms_out = outNdarray<btScalar>(transforms_out, 4, tdims);
+  npy_intp ndims[] = {n, numNodes, 3};
+  nodes_out = outNdarray<btScalar>(nodes_out, 3, ndims);
+  btScalar* transforms = getPointer<btScalar>(transforms_out);
+  btScalar* nodes = getPointer<btScalar>(nodes_out);
+
+  int steps;
+  {
+    ScopedGILRelease release;
+    steps = StepN(n, dt, maxSubSteps, fixedTimeStep, objs, transforms, ropes, nodes, stopOn);
+  }
+  return py::make_tuple(steps, transforms_out, nodes_out);
+}
+
+int BulletEnvironment::CheckTrajectory(BulletObjectPtr robot, const vector<int>& dofIndices, const dReal* traj, int n,
+                                       vector<char>* collides, bool continuous) {
+  RaveRobotObject::Ptr robotObj = boost::dynamic_pointer_cast<RaveRobotObject>(robot->m_obj);
+  if (!robotObj) {
+    throw std::runtime_error((boost::format("CheckTrajectory: %s is not a robot") % robot->GetName()).str());
+  }
+  if (!m_contactTester) m_contactTester.reset(new ParallelContactTester(m_env->bullet));
+  int nThreads = GetSimParams()->checkThreads > 0 ? GetSimParams()->checkThreads : ThreadPool::hardwareThreads();
+  if (!m_checkThreads || m_checkThreads->numThreads() != nThreads) m_checkThreads.reset(new ThreadPool(nThreads));
+  return robotObj->checkTrajectory(dofIndices, traj, n, *m_contactTester, *m_checkThreads, collides, continuous);
+}
+
+py::object BulletEnvironment::py_CheckTrajectory(BulletObjectPtr robot, py::object py_dofIndices, py::object py_traj, bool returnMask,
+                                                  bool continuous) {
+  vector<int> dofIndices;
+  for (int i = 0; i < py::len(py_dofIndices); ++i) {
+    dofIndices.push_back(py::extract<int>(py_dofIndices[i]));
+  }
+  py::object traj = ensureFormat<dReal>(py_traj);
+  npy_intp dims[] = {PyArray_NDIM((PyArrayObject*) traj.ptr()) == 2 ? PyArray_DIM((PyArrayObject*) traj.ptr(), 0) : 0,
+                     (npy_intp) dofIndices.size()};
+  traj = ensureShape<dReal>(traj, 2, dims);
+  const dReal* ptraj = getPointer<dReal>(traj);
+
+  vector<char> collides;
+  int first;
+  {
+    ScopedGILRelease release;
+    first = CheckTrajectory(robot, dofIndices, ptraj, dims[0], returnMask ? &collides : NULL, continuous);
+  }
+  if (!returnMask) return py::object(first);
+  py::object mask = newNdarray<npy_bool>(1, dims);
+  std::copy(collides.begin(), collides.end(), getPointer<npy_bool>(mask));
+  return mask;
+}
+
 vector<CollisionPtr> BulletEnvironment::DetectAllCollisions() {
   vector<CollisionPtr> collisions;
   btDynamicsWorld *world = m_env->bullet->dynamicsWorld;
@@ -479,10 +909,13 @@ vector<CollisionPtr> BulletEnvironment::ContactTest(BulletObjectPtr obj) {
   struct ContactCallback : public btCollisionWorld::ContactResultCallback {
     vector<CollisionPtr> &m_out;
     RaveInstance::Ptr m_rave;
-    ContactCallback(vector<CollisionPtr> &out_, RaveInstance::Ptr rave) : m_out(out_), m_rave(rave) { }
+    BulletInstance &m_bullet;
+    ContactCallback(vector<CollisionPtr> &out_, RaveInstance::Ptr rave, BulletInstance &bullet) : m_out(out_), m_rave(rave), m_bullet(bullet) { }
     btScalar addSingleResult(btManifoldPoint &pt,
                              const btCollisionObject *colObj0, int, int,
                              const btCollisionObject *colObj1, int, int) {
+      // btCollisionWorld::contactTest doesn't drop points beyond the threshold itself
+      if (pt.getDistance() > m_bullet.contactBreakingThreshold(colObj0, colObj1)) return 0;
       btRigidBody *objA = const_cast<btRigidBody *>(static_cast<const btRigidBody *>(colObj0));
       btRigidBody *objB = const_cast<btRigidBody *>(static_cast<const btRigidBody *>(colObj1));
       KinBody::LinkPtr linkA = findOrFail(m_rave->bulletsim2rave_links, objA);
@@ -492,7 +925,7 @@ vector<CollisionPtr> BulletEnvironment::ContactTest(BulletObjectPtr obj) {
         pt.m_normalWorldOnB/METERS, pt.m_distance1/METERS, 1.)));
       return 0;
     }
-  } cb(out, m_rave);
+  } cb(out, m_rave, *m_env->bullet);
 
   // do contact test for all links of obj
   RaveObject::ChildVector& obj_children = obj->m_obj->getChildren();
@@ -503,6 +936,117 @@ vector<CollisionPtr> BulletEnvironment::ContactTest(BulletObjectPtr obj) {
   return out;
 }
 
+CollisionBatchPtr BulletEnvironment::DetectAllCollisionsBatch() {
+  return DetectAllCollisionsBatch(CollisionBatchPtr(new CollisionBatch));
+}
+
+CollisionBatchPtr BulletEnvironment::DetectAllCollisionsBatch(CollisionBatchPtr out) {
+  out->Clear();
+  btCollisionDispatcher *dispatcher = m_env->bullet->dispatcher;
+  int numManifolds = dispatcher->getNumManifolds();
+  int numContacts = 0;
+  for (int i = 0; i < numManifolds; ++i) {
+    numContacts += dispatcher->getManifoldByIndexInternal(i)->getNumContacts();
+  }
+  out->Reserve(numContacts);
+  for (int i = 0; i < numManifolds; ++i) {
+    btPersistentManifold* contactManifold = dispatcher->getManifoldByIndexInternal(i);
+    int n = contactManifold->getNumContacts();
+    if (n == 0) continue;
+    // links are looked up once per manifold, not per contact
+    btRigidBody *objA = static_cast<btRigidBody *>(contactManifold->getBody0());
+    btRigidBody *objB = static_cast<btRigidBody *>(contactManifold->getBody1());
+    const KinBody::Link &linkA = *findOrFail(m_rave->bulletsim2rave_links, objA);
+    const KinBody::Link &linkB = *findOrFail(m_rave->bulletsim2rave_links, objB);
+    for (int j = 0; j < n; ++j) {
+      out->Add(linkA, linkB, contactManifold->getContactPoint(j), 1./n);
+    }
+  }
+  return out;
+}
+
+CollisionBatchPtr BulletEnvironment::ContactTestBatch(BulletObjectPtr obj) {
+  return ContactTestBatch(obj, CollisionBatchPtr(new CollisionBatch));
+}
+
+CollisionBatchPtr BulletEnvironment::ContactTestBatch(BulletObjectPtr obj, CollisionBatchPtr out) {
+  out->Clear();
+  struct ContactCallback : public btCollisionWorld::ContactResultCallback {
+    CollisionBatch &m_out;
+    RaveInstance::Ptr m_rave;
+    BulletInstance &m_bullet;
+    // callbacks come grouped by object pair, so remember the last lookup
+    const btCollisionObject *m_lastObj[2];
+    KinBody::Link *m_lastLink[2];
+    ContactCallback(CollisionBatch &out_, RaveInstance::Ptr rave, BulletInstance &bullet) : m_out(out_), m_rave(rave), m_bullet(bullet) {
+      m_lastObj[0] = m_lastObj[1] = NULL;
+    }
+    KinBody::Link &lookup(int k, const btCollisionObject *obj) {
+      if (obj != m_lastObj[k]) {
+        btRigidBody *rb = const_cast<btRigidBody *>(static_cast<const btRigidBody *>(obj));
+        m_lastLink[k] = findOrFail(m_rave->bulletsim2rave_links, rb).get();
+        m_lastObj[k] = obj;
+      }
+      return *m_lastLink[k];
+    }
+    btScalar addSingleResult(btManifoldPoint &pt,
+                             const btCollisionObject *colObj0, int, int,
+                             const btCollisionObject *colObj1, int, int) {
+      if (pt.getDistance() > m_bullet.contactBreakingThreshold(colObj0, colObj1)) return 0;
+      m_out.Add(lookup(0, colObj0), lookup(1, colObj1), pt, 1.);
+      return 0;
+    }
+  } cb(*out, m_rave, *m_env->bullet);
+
+  RaveObject::ChildVector& obj_children = obj->m_obj->getChildren();
+  for (int i = 0; i < obj_children.size(); ++i) {
+    m_env->bullet->dynamicsWorld->contactTest(obj_children[i]->rigidBody.get(), cb);
+  }
+  return out;
+}
+
+CollisionBatchPtr BulletEnvironment::ComputeDistances(const vector<BulletObjectPtr>& objs, double maxDist) {
+  return ComputeDistances(objs, maxDist, CollisionBatchPtr(new CollisionBatch));
+}
+
+CollisionBatchPtr BulletEnvironment::ComputeDistances(const vector<BulletObjectPtr>& objs, double maxDist, CollisionBatchPtr out) {
+  out->Clear();
+  m_env->bullet->dynamicsWorld->updateAabbs();
+  vector<DistanceResult> results;
+  // children of the objects already done, so their pairs with later ones aren't repeated
+  vector<const btCollisionObject*> done;
+  BOOST_FOREACH(BulletObjectPtr obj, objs) {
+    CollisionObjectMask ignore = obj->m_obj->getIgnoredCollisionObjs();
+    RaveObject::ChildVector& children = obj->m_obj->getChildren();
+    for (int i = 0; i < children.size(); ++i) ignore.insert(children[i]->rigidBody.get());
+    for (int i = 0; i < done.size(); ++i) ignore.insert(done[i]);
+    ignore.update();
+
+    for (int i = 0; i < children.size(); ++i) {
+      btRigidBody* body = children[i]->rigidBody.get();
+      results.clear();
+      m_env->bullet->distanceTest(body, maxDist*METERS, ignore, results);
+      if (results.empty()) continue;
+      KinBody::LinkPtr linkA = findOrFail(m_rave->bulletsim2rave_links, body);
+      for (int j = 0; j < results.size(); ++j) {
+        // e.g. rope segments, which have no link
+        btRigidBody* other = const_cast<btRigidBody*>(btRigidBody::upcast(results[j].objB));
+        std::map<btRigidBody*, KinBody::LinkPtr>::const_iterator linkB = m_rave->bulletsim2rave_links.find(other);
+        if (linkB != m_rave->bulletsim2rave_links.end()) out->Add(*linkA, *linkB->second, results[j]);
+      }
+    }
+    for (int i = 0; i < children.size(); ++i) done.push_back(children[i]->rigidBody.get());
+  }
+  return out;
+}
+
+CollisionBatchPtr BulletEnvironment::py_ComputeDistances(py::object py_objs, double maxDist, CollisionBatchPtr out) {
+  vector<BulletObjectPtr> objs = toBulletObjectVec(py_objs);
+  if (!out) out.reset(new CollisionBatch);
+  ScopedGILRelease release;
+  return ComputeDistances(objs, maxDist, out);
+}
+
 void BulletEnvironment::SetContactDistance(double dist) {
   LOG_DEBUG_FMT("setting contact distance to %.2f", dist);
   //m_contactDistance = dist;
@@ -516,6 +1060,57 @@ void BulletEnvironment::SetContactDistance(double dist) {
   dispatcher->setDispatcherFlags(dispatcher->getDispatcherFlags() & ~btCollisionDispatcher::CD_USE_RELATIVE_CONTACT_BREAKING_THRESHOLD);
 }
 
+EnvironmentState::Ptr BulletEnvironment::SaveState() {
+  return m_env->saveState();
+}
+
+EnvironmentState::Ptr BulletEnvironment::SaveState(EnvironmentState::Ptr state) {
+  m_env->saveState(*state);
+  return state;
+}
+
+void BulletEnvironment::RestoreState(EnvironmentState::Ptr state) {
+  m_env->restoreState(*state);
+}
+
+static py::dict toDict(const StepProfiler::Stats &s) {
+  py::dict out;
+  out["count"] = s.count;
+  out["last"] = s.last;
+  out["mean"] = s.mean();
+  out["min"] = s.count ? s.min : 0;
+  out["max"] = s.max;
+  out["p50"] = s.percentile(50);
+  out["p90"] = s.percentile(90);
+  out["p99"] = s.percentile(99);
+  out["histogram"] = toNdarray1<unsigned long>(s.histogram, StepProfiler::NUM_BUCKETS);
+  return out;
+}
+
+py::dict BulletEnvironment::GetStepProfile() {
+  const StepProfiler &p = *m_env->bullet->profiler;
+  py::dict phases, counters;
+  for (int i = 0; i < StepProfiler::NUM_PHASES; ++i) {
+    phases[StepProfiler::name((StepProfiler::Phase) i)] = toDict(p.getStats((StepProfiler::Phase) i));
+  }
+  for (int i = 0; i < StepProfiler::NUM_COUNTERS; ++i) {
+    counters[StepProfiler::name((StepProfiler::Counter) i)] = toDict(p.getStats((StepProfiler::Counter) i));
+  }
+  py::dict out;
+  out["steps"] = p.numSteps();
+  out["phases"] = phases;
+  out["counters"] = counters;
+  return out;
+}
+
+void BulletEnvironment::ResetStepProfile() {
+  m_env->bullet->profiler->reset();
+}
+
+void BulletEnvironment::SetStepProfilerEnabled(bool enabled) {
+  m_env->bullet->profiler->enabled = enabled;
+}
+
 
 BulletConstraint::Ptr BulletEnvironment::AddConstraint(BulletConstraint::Ptr cnt) {
   m_env->addConstraint(cnt);
@@ -577,6 +1172,7 @@ void BulletEnvironment::RemoveConstraint(BulletConstraint::Ptr cnt) {
 }
 
 void BulletEnvironment::Remove(BulletObjectPtr obj) {
+  m_wrappers.erase(obj->m_obj.get());
   m_env->remove(obj->m_obj);
 }
 
@@ -585,6 +1181,61 @@ void BulletEnvironment::Add(BulletObjectPtr obj) {
 }
 
 
+void EnvironmentPool::init(EnvironmentBasePtr rave_env, const vector<string>& dynamic_obj_names, int n, int num_threads) {
+  if (n < 0) {
+    throw std::runtime_error((boost::format("expected a nonnegative number of environments, got %d") % n).str());
+  }
+  m_envs.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    m_envs.push_back(BulletEnvironmentPtr(new BulletEnvironment(rave_env, dynamic_obj_names)));
+  }
+  m_threads.reset(new ThreadPool(num_threads));
+  LOG_DEBUG_FMT("created pool of %d environments on %d threads", n, m_threads->numThreads());
+}
+
+EnvironmentPool::EnvironmentPool(EnvironmentBasePtr rave_env, const vector<string>& dynamic_obj_names, int n, int num_threads) {
+  init(rave_env, dynamic_obj_names, n, num_threads);
+}
+
+EnvironmentPool::EnvironmentPool(py::object py_rave_env, py::list dynamic_obj_names, int n) {
+  init(GetCppEnv(py_rave_env), toStrVec(dynamic_obj_names), n, 0);
+}
+
+EnvironmentPool::EnvironmentPool(py::object py_rave_env, py::list dynamic_obj_names, int n, int num_threads) {
+  init(GetCppEnv(py_rave_env), toStrVec(dynamic_obj_names), n, num_threads);
+}
+
+int EnvironmentPool::Size() {
+  return m_envs.size();
+}
+
+int EnvironmentPool::GetNumThreads() {
+  return m_threads->numThreads();
+}
+
+BulletEnvironmentPtr EnvironmentPool::GetEnvironment(int i) {
+  if (i < 0 || i >= m_envs.size()) {
+    throw std::runtime_error((boost::format("environment index %d out of range [0, %d)") % i % m_envs.size()).str());
+  }
+  return m_envs[i];
+}
+
+vector<BulletEnvironmentPtr> EnvironmentPool::GetEnvironments() {
+  return m_envs;
+}
+
+void EnvironmentPool::stepOne(int i, float dt, int maxSubSteps, float fixedTimeStep) {
+  m_envs[i]->Step(dt, maxSubSteps, fixedTimeStep);
+}
+
+void EnvironmentPool::StepAll(float dt, int maxSubSteps, float fixedTimeStep) {
+  // the environments don't share any Bullet state, so each one can be
+  // stepped on its own thread
+  m_threads->parallelFor(m_envs.size(),
+    boost::bind(&EnvironmentPool::stepOne, this, _1, dt, maxSubSteps, fixedTimeStep));
+}
+
+
 
 static string makeRaveCylsXML(string name, btScalar radius, const vector<btScalar> &lengths) {
   stringstream xml;
@@ -616,7 +1267,7 @@ CapsuleRope::CapsuleRope(BulletEnvironmentPtr env, const string& name, const vec
 
 CapsuleRope::CapsuleRope(BulletEnvironmentPtr env, const string& name, py::object ctrlPoints, const CapsuleRopeParams& params) {
   vector<btVector3> v;
-  fromNdarray2ToBtVecs(numpy.attr("asarray")(ctrlPoints), v);
+  fromNdarray2ToBtVecs(ctrlPoints, v);
   init(env, name, v, params);
 }
 
@@ -701,7 +1352,7 @@ vector<btMatrix3x3> CapsuleRope::GetRotations() {
 }
 void CapsuleRope::SetRotations(py::object rots) {
   vector<btMatrix3x3> m;
-  fromNdarray3ToBtMats(numpy.attr("asarray")(rots), m);
+  fromNdarray3ToBtMats(rots, m);
   CapsuleRope_setRotations(m_children_rigidbodies, m);
 }
 std::vector<btVector3> CapsuleRope::GetTranslations() {
@@ -711,7 +1362,7 @@ std::vector<btVector3> CapsuleRope::GetTranslations() {
 }
 void CapsuleRope::SetTranslations(py::object trans) {
   vector<btVector3> v;
-  fromNdarray2ToBtVecs(numpy.attr("asarray")(trans), v);
+  fromNdarray2ToBtVecs(trans, v);
   scale(v, METERS);
   CapsuleRope_setTranslations(m_children_rigidbodies, v);
 }
@@ -721,12 +1372,12 @@ vector<float> CapsuleRope::GetHalfHeights() {
   return out;
 }
 
-py::object CapsuleRope::py_GetNodes() { return toNdarray2(GetNodes()); }
-py::object CapsuleRope::py_GetControlPoints() { return toNdarray2(GetControlPoints()); }
-py::object CapsuleRope::py_GetRotations() { return toNdarray3(GetRotations()); }
+py::object CapsuleRope::py_GetNodes(py::object out) { return toNdarray2(GetNodes(), out); }
+py::object CapsuleRope::py_GetControlPoints(py::object out) { return toNdarray2(GetControlPoints(), out); }
+py::object CapsuleRope::py_GetRotations(py::object out) { return toNdarray3(GetRotations(), out); }
 void CapsuleRope::py_SetRotations(py::object py_rots) { return SetRotations(py_rots); }
-py::object CapsuleRope::py_GetTranslations() { return toNdarray2(GetTranslations()); }
+py::object CapsuleRope::py_GetTranslations(py::object out) { return toNdarray2(GetTranslations(), out); }
 void CapsuleRope::py_SetTranslations(py::object py_trans) { return SetTranslations(py_trans); }
-py::object CapsuleRope::py_GetHalfHeights() { return toNdarray(GetHalfHeights()); }
+py::object CapsuleRope::py_GetHalfHeights(py::object out) { return toNdarray(GetHalfHeights(), out); }
 
 } // namespace bs
@@ -3,6 +3,8 @@
 #include <boost/python.hpp>
 #include "environment.h"
 #include "openravesupport.h"
+#include "thread_pool.h"
+#include "collision_checking.h"
 #include "macros.h"
 
 namespace bs {
@@ -12,11 +14,24 @@ using namespace OpenRAVE;
 namespace py = boost::python;
 
 void InitPython();
+
+// Releases the GIL for its lifetime, so other python threads can run while we're
+// in C++. Whatever runs inside must not touch python objects (including the
+// reference counts of python-owned arguments dropping to zero).
+class ScopedGILRelease {
+public:
+  ScopedGILRelease() : m_state(PyEval_SaveThread()) { }
+  ~ScopedGILRelease() { PyEval_RestoreThread(m_state); }
+private:
+  PyThreadState *m_state;
+};
+
 struct SimulationParams; typedef boost::shared_ptr<SimulationParams> SimulationParamsPtr;
 SimulationParamsPtr GetSimParams();
 void TranslateStdException(const std::exception& e);
 
 class BulletEnvironment;
+class CapsuleRope; typedef boost::shared_ptr<CapsuleRope> CapsuleRopePtr;
 class BULLETSIM_API BulletObject {
 public:
   virtual ~BulletObject() { }
@@ -28,11 +43,18 @@ public:
   py::object py_GetKinBody();
 
   virtual btTransform GetTransform();
-  virtual py::object py_GetTransform();
+  // out: optional preallocated 4x4 float32 array to fill and return
+  virtual py::object py_GetTransform(py::object out=py::object());
 
   virtual void SetTransform(const btTransform& t);
   virtual void py_SetTransform(py::object py_hmat);
 
+  virtual btVector3 GetLinearVelocity();
+  virtual py::object py_GetLinearVelocity();
+
+  virtual btVector3 GetAngularVelocity();
+  virtual py::object py_GetAngularVelocity();
+
   virtual void SetLinearVelocity(const btVector3& v);
   virtual void py_SetLinearVelocity(py::list v);
 
@@ -42,6 +64,13 @@ public:
   virtual void UpdateBullet();
   virtual void UpdateRave();
 
+  // stops link pairs that can't touch from ever reaching the narrowphase, see
+  // RaveObject::disableNeverCollidingLinks. Returns the number of pairs disabled
+  int DisableNeverCollidingLinks(int samples);
+
+  // number of convex pieces and triangle meshes making up the links' collision shapes
+  int GetNumCollisionShapes();
+
 protected:
   friend class BulletEnvironment;
   BulletObject() { }
@@ -70,6 +99,34 @@ struct BULLETSIM_API Collision {
   CollisionPtr Flipped() const;
 };
 
+// Collision results as parallel arrays, row i of each array describing contact i
+// (same fields and units as Collision). Links are identified by the environment id
+// of their KinBody and their index in it: env.GetBodyFromEnvironmentId(bodyA[i]).GetLinks()[linkA[i]].
+// Refilling a batch reuses its storage.
+struct CollisionBatch;
+typedef boost::shared_ptr<CollisionBatch> CollisionBatchPtr;
+struct BULLETSIM_API CollisionBatch {
+  vector<btScalar> ptA, ptB, normalB2A; // 3 per contact
+  vector<btScalar> distance, weight;
+  vector<int> bodyA, linkA, bodyB, linkB;
+
+  int Size() const { return distance.size(); }
+  void Clear();
+  void Reserve(int n);
+  void Add(const KinBody::Link &a, const KinBody::Link &b, const btManifoldPoint &pt, double weight);
+  void Add(const KinBody::Link &a, const KinBody::Link &b, const DistanceResult &r);
+
+  py::object py_ptA();
+  py::object py_ptB();
+  py::object py_normalB2A();
+  py::object py_distance();
+  py::object py_weight();
+  py::object py_bodyA();
+  py::object py_linkA();
+  py::object py_bodyB();
+  py::object py_linkB();
+};
+
 struct BULLETSIM_API SimulationParams {
   float scale;
   btVector3 gravity;
@@ -80,11 +137,39 @@ struct BULLETSIM_API SimulationParams {
   float restitution;
   float margin;
   float linkPadding;
+  int numThreads;
+  int solverType;
+  int manifoldPoolSize;
+  string shapeCacheDir;
+  int trimeshMode;
+  int hacdMinClusters;
+  int hacdMaxVerticesPerHull;
+  float hacdConcavity;
+  int loadThreads;
+  int checkThreads;
 
   SimulationParams();
   void Apply();
 };
 
+// Threading: the python bindings release the GIL during Step, StepN, DetectAllCollisions,
+// ContactTest (and their Batch variants), CheckTrajectory, ComputeDistances and
+// EnvironmentPool::StepAll.
+// - Different BulletEnvironments may be used concurrently from different threads.
+//   Each has its own Bullet world, dispatcher and solver (and threads, if any).
+//   The calls above only read the OpenRAVE environment, except CheckTrajectory and
+//   DisableNeverCollidingLinks: they set the robot's DOF values while they sample
+//   (with the environment lock held, restoring them before returning). Don't run them
+//   while other threads use that robot, or environments built from the same OpenRAVE one.
+// - A single BulletEnvironment, and the objects, constraints and states obtained from it,
+//   must be used by one thread at a time. That includes calls that keep the GIL,
+//   e.g. reading a transform while another thread is in Step is a data race.
+// - Calls that write to the OpenRAVE environment (UpdateRave, CapsuleRope::UpdateRave,
+//   SyncToRave) affect every BulletEnvironment created from it. Hold the OpenRAVE
+//   environment lock (SyncToRave takes it) and don't run them while other threads are
+//   stepping environments built from it.
+// - SimulationParams (sim_params) are global. Apply them before creating
+//   environments on other threads.
 class BULLETSIM_API BulletEnvironment {
 public:
   BulletEnvironment(EnvironmentBasePtr rave_env, const vector<string>& dynamic_obj_names);
@@ -113,13 +198,92 @@ public:
   btVector3 GetGravity();
   py::object py_GetGravity();
 
+  // Batched BulletObject getters and setters, one python call for many objects:
+  // row i of the array belongs to objs[i] (a sequence of BulletObjects, or None for
+  // GetDynamicObjects()). Transforms are n x 4 x 4, velocities n x 3. The getters
+  // fill out if given.
+  py::object py_GetTransforms(py::object objs, py::object out);
+  void py_SetTransforms(py::object objs, py::object transforms);
+  py::object py_GetLinearVelocities(py::object objs, py::object out);
+  void py_SetLinearVelocities(py::object objs, py::object v);
+  py::object py_GetAngularVelocities(py::object objs, py::object out);
+  void py_SetAngularVelocities(py::object objs, py::object w);
+
+  // Scene-wide UpdateRave and UpdateBullet. Both take the OpenRAVE environment lock once
+  // and return the number of objects they updated.
+  // SyncToRave writes the dynamic objects that moved more than threshold since they were
+  // last synced, including those that have fallen asleep since. SyncFromRave updates the kinematic objects
+  // whose KinBodies changed in OpenRAVE.
+  int SyncToRave(float threshold=0);
+  int SyncFromRave();
+
   void Step(float dt, int maxSubSteps, float fixedTimeStep);
 
+  // conditions for StepN to stop early (flags)
+  enum StopCondition {
+    STOP_ON_CONTACT = 1, // one of the recorded objects or ropes is penetrating something
+    STOP_ON_NAN = 2      // a recorded transform or node isn't finite
+  };
+  // Runs up to n steps of Step(dt, maxSubSteps, fixedTimeStep). After step i, the transforms
+  // of objs are written to transforms[i] (objs.size() row-major 4x4 matrices) and the nodes of
+  // ropes, one rope after the other, to nodes[i] (3 per node). Either buffer may be NULL.
+  // Stops after the first step that meets one of the stopOn conditions.
+  // Returns the number of steps run.
+  int StepN(int n, float dt, int maxSubSteps, float fixedTimeStep,
+            const vector<BulletObjectPtr>& objs, btScalar* transforms,
+            const vector<CapsuleRopePtr>& ropes, btScalar* nodes, int stopOn=0);
+  // python: returns (steps run, transforms, nodes) with arrays of shape
+  // (n, len(objs), 4, 4) and (n, total number of rope nodes, 3), filling
+  // transforms_out and nodes_out if given. Rows past the steps run aren't written.
+  py::tuple py_StepN(int n, float dt, int maxSubSteps, float fixedTimeStep,
+                     py::list objs, py::list ropes, py::object transforms_out, py::object nodes_out, int stopOn);
+
   vector<CollisionPtr> DetectAllCollisions();
   vector<CollisionPtr> ContactTest(BulletObjectPtr obj);
 
+  // same as above, but filling a CollisionBatch (a new one if not given)
+  CollisionBatchPtr DetectAllCollisionsBatch();
+  CollisionBatchPtr DetectAllCollisionsBatch(CollisionBatchPtr out);
+  CollisionBatchPtr ContactTestBatch(BulletObjectPtr obj);
+  CollisionBatchPtr ContactTestBatch(BulletObjectPtr obj, CollisionBatchPtr out);
+
+  // Signed distances between the links of objs and everything else within maxDist of them,
+  // without stepping or depending on contact history (see BulletInstance::distanceTest):
+  // one entry per pair of convex parts, with weight 1. Links of one object aren't checked
+  // against each other or what it ignores (grabbed objects), and pairs of objs are reported
+  // once. Only the broadphase AABBs are brought up to date; nothing else in the world changes.
+  CollisionBatchPtr ComputeDistances(const vector<BulletObjectPtr>& objs, double maxDist);
+  CollisionBatchPtr ComputeDistances(const vector<BulletObjectPtr>& objs, double maxDist, CollisionBatchPtr out);
+  // python: objs is a list. Releases the GIL
+  CollisionBatchPtr py_ComputeDistances(py::object objs, double maxDist, CollisionBatchPtr out);
+
+  // Collision checks configurations of a robot's DOFs without moving anything or stepping
+  // (see RaveRobotObject::checkTrajectory): traj holds n waypoints of dofIndices.size()
+  // values. Waypoints are checked on sim_params.checkThreads threads (0: one per core),
+  // read on every call. Returns the first colliding waypoint, -1 if none; if collides
+  // is given, every waypoint is checked and collides gets one entry per waypoint.
+  // With continuous, the motion between consecutive waypoints is checked too.
+  int CheckTrajectory(BulletObjectPtr robot, const vector<int>& dofIndices, const dReal* traj, int n,
+                      vector<char>* collides=NULL, bool continuous=false);
+  // python: traj is a (T, len(dofIndices)) array. Returns the first colliding waypoint,
+  // or with returnMask, a boolean array of length T. Releases the GIL
+  py::object py_CheckTrajectory(BulletObjectPtr robot, py::object dofIndices, py::object traj, bool returnMask,
+                                bool continuous);
+
   void SetContactDistance(double dist);
 
+  // snapshot and roll back the dynamic state (see Environment::saveState).
+  // the second form reuses the buffers of an earlier snapshot
+  EnvironmentState::Ptr SaveState();
+  EnvironmentState::Ptr SaveState(EnvironmentState::Ptr state);
+  void RestoreState(EnvironmentState::Ptr state);
+
+  // statistics of the time spent in each phase of Step (in seconds) and of
+  // per-step counters, see StepProfiler
+  py::dict GetStepProfile();
+  void ResetStepProfile();
+  void SetStepProfilerEnabled(bool enabled);
+
   BulletConstraint::Ptr AddConstraint(BulletConstraint::Ptr cnt);
   BulletConstraint::Ptr py_AddConstraint(py::dict desc);
   void RemoveConstraint(BulletConstraint::Ptr cnt);
@@ -131,10 +295,44 @@ private:
   Environment::Ptr m_env;
   RaveInstance::Ptr m_rave;
   vector<string> m_dynamic_obj_names;
+  // the wrappers handed out so far, so repeated lookups don't allocate
+  boost::unordered_map<RaveObject*, BulletObjectPtr> m_wrappers;
+  // for CheckTrajectory, created on first use; the pool is resized when checkThreads changes
+  ParallelContactTester::Ptr m_contactTester;
+  ThreadPool::Ptr m_checkThreads;
   void init(EnvironmentBasePtr rave_env, const vector<string>& dynamic_obj_names);
+  BulletObjectPtr wrap(RaveObject::Ptr obj);
+  vector<BulletObjectPtr> toObjects(py::object objs);
 };
 typedef boost::shared_ptr<BulletEnvironment> BulletEnvironmentPtr;
 
+// A set of independent BulletEnvironments (e.g. one per rollout)
+// that are stepped together on a pool of worker threads
+class BULLETSIM_API EnvironmentPool {
+public:
+  // creates n environments from the same OpenRAVE environment.
+  // num_threads <= 0 means one thread per core
+  EnvironmentPool(EnvironmentBasePtr rave_env, const vector<string>& dynamic_obj_names, int n, int num_threads=0);
+  // constructors for python interface
+  EnvironmentPool(py::object py_rave_env, py::list dynamic_obj_names, int n);
+  EnvironmentPool(py::object py_rave_env, py::list dynamic_obj_names, int n, int num_threads);
+
+  int Size();
+  int GetNumThreads();
+  BulletEnvironmentPtr GetEnvironment(int i);
+  vector<BulletEnvironmentPtr> GetEnvironments();
+
+  // equivalent to calling Step on every environment
+  void StepAll(float dt, int maxSubSteps, float fixedTimeStep);
+
+private:
+  vector<BulletEnvironmentPtr> m_envs;
+  ThreadPool::Ptr m_threads;
+  void init(EnvironmentBasePtr rave_env, const vector<string>& dynamic_obj_names, int n, int num_threads);
+  void stepOne(int i, float dt, int maxSubSteps, float fixedTimeStep);
+};
+typedef boost::shared_ptr<EnvironmentPool> EnvironmentPoolPtr;
+
 
 struct BULLETSIM_API CapsuleRopeParams {
   float radius;
@@ -162,13 +360,14 @@ public:
   void SetTranslations(py::object trans);
   vector<float> GetHalfHeights();
 
-  py::object py_GetNodes();
-  py::object py_GetControlPoints();
-  py::object py_GetRotations();
+  // out: optional preallocated float32 array of the right shape to fill and return
+  py::object py_GetNodes(py::object out=py::object());
+  py::object py_GetControlPoints(py::object out=py::object());
+  py::object py_GetRotations(py::object out=py::object());
   void py_SetRotations(py::object py_rots);
-  py::object py_GetTranslations();
+  py::object py_GetTranslations(py::object out=py::object());
   void py_SetTranslations(py::object py_trans);
-  py::object py_GetHalfHeights();
+  py::object py_GetHalfHeights(py::object out=py::object());
 
   // not supported
   virtual void UpdateBullet();
@@ -183,6 +382,5 @@ private:
 
   void init(BulletEnvironmentPtr env, const string& name, const vector<btVector3>& ctrlPoints, const CapsuleRopeParams& params);
 };
-typedef boost::shared_ptr<CapsuleRope> CapsuleRopePtr;
 
 } // namespace bs
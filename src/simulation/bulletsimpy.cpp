@@ -2,9 +2,63 @@
 #include <boost/python/suite/indexing/vector_indexing_suite.hpp>
 #include "bulletsim_lite.h"
 #include "logging.h"
+#include "shape_cache.h"
 
 namespace py = boost::python;
 
+// Wrappers for the calls that do pure C++ work (stepping and collision detection).
+// The arguments are converted and the results are converted back with the GIL held.
+static void Step(bs::BulletEnvironment &env, float dt, int maxSubSteps, float fixedTimeStep) {
+  bs::ScopedGILRelease release;
+  env.Step(dt, maxSubSteps, fixedTimeStep);
+}
+static vector<bs::CollisionPtr> DetectAllCollisions(bs::BulletEnvironment &env) {
+  bs::ScopedGILRelease release;
+  return env.DetectAllCollisions();
+}
+static vector<bs::CollisionPtr> ContactTest(bs::BulletEnvironment &env, bs::BulletObjectPtr obj) {
+  bs::ScopedGILRelease release;
+  return env.ContactTest(obj);
+}
+static bs::CollisionBatchPtr DetectAllCollisionsBatch(bs::BulletEnvironment &env, bs::CollisionBatchPtr out) {
+  if (!out) out.reset(new bs::CollisionBatch);
+  bs::ScopedGILRelease release;
+  return env.DetectAllCollisionsBatch(out);
+}
+static bs::CollisionBatchPtr ContactTestBatch(bs::BulletEnvironment &env, bs::BulletObjectPtr obj, bs::CollisionBatchPtr out) {
+  if (!out) out.reset(new bs::CollisionBatch);
+  bs::ScopedGILRelease release;
+  return env.ContactTestBatch(obj, out);
+}
+// these wait for the OpenRAVE environment lock, which a python thread may be holding
+static int SyncToRave(bs::BulletEnvironment &env, float threshold) {
+  bs::ScopedGILRelease release;
+  return env.SyncToRave(threshold);
+}
+static int SyncFromRave(bs::BulletEnvironment &env) {
+  bs::ScopedGILRelease release;
+  return env.SyncFromRave();
+}
+static int DisableNeverCollidingLinks(bs::BulletObject &obj, int samples) {
+  bs::ScopedGILRelease release;
+  return obj.DisableNeverCollidingLinks(samples);
+}
+static py::dict GetShapeCacheStats() {
+  ShapeCache::Stats stats = ShapeCache::instance().stats();
+  py::dict out;
+  out["memoryHits"] = stats.memoryHits;
+  out["diskHits"] = stats.diskHits;
+  out["misses"] = stats.misses;
+  return out;
+}
+static void ClearShapeCache() {
+  ShapeCache::instance().clear();
+}
+static void StepAll(bs::EnvironmentPool &pool, float dt, int maxSubSteps, float fixedTimeStep) {
+  bs::ScopedGILRelease release;
+  pool.StepAll(dt, maxSubSteps, fixedTimeStep);
+}
+
 BOOST_PYTHON_MODULE(cbulletsimpy) {
   LoggingInit();
   log4cplus::Logger::getRoot().setLogLevel(GeneralConfig::verbose);
@@ -17,12 +71,18 @@ BOOST_PYTHON_MODULE(cbulletsimpy) {
     .def("IsKinematic", &bs::BulletObject::IsKinematic)
     .def("GetName", &bs::BulletObject::GetName)
     .def("GetKinBody", &bs::BulletObject::py_GetKinBody, "get the KinBody in the OpenRAVE environment this object was created from")
-    .def("GetTransform", &bs::BulletObject::py_GetTransform)
+    .def("GetTransform", &bs::BulletObject::py_GetTransform, (py::arg("out")=py::object()))
     .def("SetTransform", &bs::BulletObject::py_SetTransform)
+    .def("GetLinearVelocity", &bs::BulletObject::py_GetLinearVelocity)
+    .def("GetAngularVelocity", &bs::BulletObject::py_GetAngularVelocity)
     .def("SetLinearVelocity", &bs::BulletObject::py_SetLinearVelocity)
     .def("SetAngularVelocity", &bs::BulletObject::py_SetAngularVelocity)
     .def("UpdateBullet", &bs::BulletObject::UpdateBullet, "set bullet object transform from the current transform in the OpenRAVE environment")
     .def("UpdateRave", &bs::BulletObject::UpdateRave, "set the transform in the OpenRAVE environment from what it currently is in Bullet")
+    .def("DisableNeverCollidingLinks", &DisableNeverCollidingLinks, (py::arg("samples")=1000),
+         "samples random DOF values and disables collisions between the link pairs that touched in none (or all) of them, "
+         "like the adjacent links are by default. returns the number of pairs disabled. releases the GIL")
+    .def("GetNumCollisionShapes", &bs::BulletObject::GetNumCollisionShapes, "number of convex pieces and triangle meshes in the links' collision shapes")
     ;
   py::class_<vector<bs::BulletObjectPtr> >("vector_BulletObject")
     .def(py::vector_indexing_suite<vector<bs::BulletObjectPtr>, true>());
@@ -40,8 +100,24 @@ BOOST_PYTHON_MODULE(cbulletsimpy) {
   py::class_<vector<bs::CollisionPtr> >("vector_Collision")
     .def(py::vector_indexing_suite<vector<bs::CollisionPtr>, true>());
 
+  py::class_<bs::CollisionBatch, bs::CollisionBatchPtr>("CollisionBatch")
+    .def("Size", &bs::CollisionBatch::Size)
+    .def("__len__", &bs::CollisionBatch::Size)
+    .add_property("ptA", &bs::CollisionBatch::py_ptA)
+    .add_property("ptB", &bs::CollisionBatch::py_ptB)
+    .add_property("normalB2A", &bs::CollisionBatch::py_normalB2A)
+    .add_property("distance", &bs::CollisionBatch::py_distance)
+    .add_property("weight", &bs::CollisionBatch::py_weight)
+    .add_property("bodyA", &bs::CollisionBatch::py_bodyA, "environment ids of the KinBodies of linkA")
+    .add_property("linkA", &bs::CollisionBatch::py_linkA, "link indices in bodyA")
+    .add_property("bodyB", &bs::CollisionBatch::py_bodyB)
+    .add_property("linkB", &bs::CollisionBatch::py_linkB)
+    ;
+
   py::class_<BulletConstraint, BulletConstraint::Ptr, boost::noncopyable>("BulletConstraint", py::no_init);
 
+  py::class_<EnvironmentState, EnvironmentState::Ptr, boost::noncopyable>("EnvironmentState", py::no_init);
+
   py::class_<bs::SimulationParams, bs::SimulationParamsPtr>("SimulationParams", py::no_init)
     .def_readwrite("scale", &bs::SimulationParams::scale)
     .def_readwrite("gravity", &bs::SimulationParams::gravity)
@@ -52,6 +128,16 @@ BOOST_PYTHON_MODULE(cbulletsimpy) {
     .def_readwrite("restitution", &bs::SimulationParams::restitution)
     .def_readwrite("margin", &bs::SimulationParams::margin)
     .def_readwrite("linkPadding", &bs::SimulationParams::linkPadding)
+    .def_readwrite("numThreads", &bs::SimulationParams::numThreads)
+    .def_readwrite("solverType", &bs::SimulationParams::solverType)
+    .def_readwrite("manifoldPoolSize", &bs::SimulationParams::manifoldPoolSize, "contact manifolds the parallel solver can hold; Step raises beyond that, and the environment can't be used afterwards")
+    .def_readwrite("shapeCacheDir", &bs::SimulationParams::shapeCacheDir, "directory for cached convex hulls, decompositions and BVHs, shared between processes (empty: cache in memory only)")
+    .def_readwrite("trimeshMode", &bs::SimulationParams::trimeshMode, "TRIMESH_CONVEX_HULL, TRIMESH_RAW or TRIMESH_CONVEX_DECOMPOSITION")
+    .def_readwrite("hacdMinClusters", &bs::SimulationParams::hacdMinClusters)
+    .def_readwrite("hacdMaxVerticesPerHull", &bs::SimulationParams::hacdMaxVerticesPerHull)
+    .def_readwrite("hacdConcavity", &bs::SimulationParams::hacdConcavity)
+    .def_readwrite("loadThreads", &bs::SimulationParams::loadThreads, "threads building link shapes while loading a scene (0: one per core)")
+    .def_readwrite("checkThreads", &bs::SimulationParams::checkThreads, "threads checking waypoints in CheckTrajectory, read on every call (0: one per core)")
     ;
 
   py::class_<bs::BulletEnvironment, bs::BulletEnvironmentPtr>("BulletEnvironment", py::init<py::object, py::list>())
@@ -62,15 +148,61 @@ BOOST_PYTHON_MODULE(cbulletsimpy) {
     .def("GetRaveEnv", &bs::BulletEnvironment::py_GetRaveEnv, "get the backing OpenRAVE environment")
     .def("SetGravity", &bs::BulletEnvironment::py_SetGravity)
     .def("GetGravity", &bs::BulletEnvironment::py_GetGravity)
-    .def("Step", &bs::BulletEnvironment::Step)
-    .def("DetectAllCollisions", &bs::BulletEnvironment::DetectAllCollisions)
-    .def("ContactTest", &bs::BulletEnvironment::ContactTest)
+    .def("GetTransforms", &bs::BulletEnvironment::py_GetTransforms, (py::arg("objs")=py::object(), py::arg("out")=py::object()),
+         "transforms of objs (default: the dynamic objects) as an n x 4 x 4 array")
+    .def("SetTransforms", &bs::BulletEnvironment::py_SetTransforms, (py::arg("objs"), py::arg("transforms")))
+    .def("GetLinearVelocities", &bs::BulletEnvironment::py_GetLinearVelocities, (py::arg("objs")=py::object(), py::arg("out")=py::object()))
+    .def("SetLinearVelocities", &bs::BulletEnvironment::py_SetLinearVelocities, (py::arg("objs"), py::arg("v")))
+    .def("GetAngularVelocities", &bs::BulletEnvironment::py_GetAngularVelocities, (py::arg("objs")=py::object(), py::arg("out")=py::object()))
+    .def("SetAngularVelocities", &bs::BulletEnvironment::py_SetAngularVelocities, (py::arg("objs"), py::arg("w")))
+    .def("SyncToRave", &SyncToRave, (py::arg("threshold")=0),
+         "UpdateRave for all the dynamic objects that moved more than threshold since the last sync, under one lock. returns the number updated")
+    .def("SyncFromRave", &SyncFromRave, "UpdateBullet for all the kinematic objects that changed in OpenRAVE, under one lock. returns the number updated")
+    .def("Step", &Step, "step the simulation. releases the GIL")
+    .def("StepN", &bs::BulletEnvironment::py_StepN,
+         (py::arg("n"), py::arg("dt"), py::arg("maxSubSteps"), py::arg("fixedTimeStep"),
+          py::arg("objs")=py::list(), py::arg("ropes")=py::list(),
+          py::arg("transforms_out")=py::object(), py::arg("nodes_out")=py::object(), py::arg("stopOn")=0),
+         "run up to n steps, recording the transforms of objs and the nodes of ropes after each one. "
+         "returns (steps run, transforms, nodes). stopOn: STOP_ON_CONTACT | STOP_ON_NAN. releases the GIL")
+    .def("DetectAllCollisions", &DetectAllCollisions, "releases the GIL")
+    .def("ContactTest", &ContactTest, "releases the GIL")
+    .def("DetectAllCollisionsBatch", &DetectAllCollisionsBatch, (py::arg("out")=bs::CollisionBatchPtr()), "like DetectAllCollisions, but returning a CollisionBatch of arrays. if out is given, it's refilled and returned. releases the GIL")
+    .def("ContactTestBatch", &ContactTestBatch, (py::arg("obj"), py::arg("out")=bs::CollisionBatchPtr()), "like ContactTest, but returning a CollisionBatch of arrays. if out is given, it's refilled and returned. releases the GIL")
+    .def("ComputeDistances", &bs::BulletEnvironment::py_ComputeDistances,
+         (py::arg("objs"), py::arg("max_dist"), py::arg("out")=bs::CollisionBatchPtr()),
+         "signed distances (negative: penetration) between the links of objs and everything within max_dist of them, "
+         "as a CollisionBatch with one entry per pair of convex parts. doesn't step or use cached contacts. "
+         "if out is given, it's refilled and returned. releases the GIL")
+    .def("CheckTrajectory", &bs::BulletEnvironment::py_CheckTrajectory,
+         (py::arg("robot"), py::arg("dof_indices"), py::arg("traj"), py::arg("return_mask")=false, py::arg("continuous")=false),
+         "collision checks a (T, len(dof_indices)) array of robot configurations without stepping. "
+         "returns the first colliding waypoint (-1 if none), or a boolean array with return_mask. "
+         "with continuous, the links are also swept between consecutive waypoints, and a waypoint collides "
+         "if the motion to the next one does. releases the GIL")
     .def("SetContactDistance", &bs::BulletEnvironment::SetContactDistance)
+    .def("SaveState", (EnvironmentState::Ptr (bs::BulletEnvironment::*)()) &bs::BulletEnvironment::SaveState, "snapshot the dynamic state of the Bullet world")
+    .def("SaveState", (EnvironmentState::Ptr (bs::BulletEnvironment::*)(EnvironmentState::Ptr)) &bs::BulletEnvironment::SaveState, "snapshot the dynamic state into an existing EnvironmentState")
+    .def("RestoreState", &bs::BulletEnvironment::RestoreState, "roll back to a snapshot taken with SaveState")
+    .def("GetStepProfile", &bs::BulletEnvironment::GetStepProfile, "per-phase timings (seconds) and counters of Step: count, last, mean, min, max, p50/p90/p99 over the last 256 steps, and a histogram with power-of-two buckets (in microseconds for times)")
+    .def("ResetStepProfile", &bs::BulletEnvironment::ResetStepProfile)
+    .def("SetStepProfilerEnabled", &bs::BulletEnvironment::SetStepProfilerEnabled)
     .def("AddConstraint", &bs::BulletEnvironment::py_AddConstraint)
     .def("RemoveConstraint", &bs::BulletEnvironment::RemoveConstraint)
     .def("Remove", &bs::BulletEnvironment::Remove)
     .def("Add", &bs::BulletEnvironment::Add)
     ;
+  py::class_<vector<bs::BulletEnvironmentPtr> >("vector_BulletEnvironment")
+    .def(py::vector_indexing_suite<vector<bs::BulletEnvironmentPtr>, true>());
+
+  py::class_<bs::EnvironmentPool, bs::EnvironmentPoolPtr, boost::noncopyable>("EnvironmentPool", py::init<py::object, py::list, int>())
+    .def(py::init<py::object, py::list, int, int>())
+    .def("Size", &bs::EnvironmentPool::Size)
+    .def("GetNumThreads", &bs::EnvironmentPool::GetNumThreads)
+    .def("GetEnvironment", &bs::EnvironmentPool::GetEnvironment)
+    .def("GetEnvironments", &bs::EnvironmentPool::GetEnvironments)
+    .def("StepAll", &StepAll, "step every environment, in parallel on the pool's worker threads. releases the GIL")
+    ;
 
   py::class_<bs::CapsuleRopeParams>("CapsuleRopeParams")
     .def_readwrite("radius", &bs::CapsuleRopeParams::radius)
@@ -82,14 +214,21 @@ BOOST_PYTHON_MODULE(cbulletsimpy) {
     ;
 
   py::class_<bs::CapsuleRope, bs::CapsuleRopePtr, py::bases<bs::BulletObject> >("CapsuleRope", py::init<bs::BulletEnvironmentPtr, const string&, py::object, const bs::CapsuleRopeParams&>())
-    .def("GetNodes", &bs::CapsuleRope::py_GetNodes)
-    .def("GetControlPoints", &bs::CapsuleRope::py_GetControlPoints)
-    .def("GetRotations", &bs::CapsuleRope::py_GetRotations)
+    .def("GetNodes", &bs::CapsuleRope::py_GetNodes, (py::arg("out")=py::object()))
+    .def("GetControlPoints", &bs::CapsuleRope::py_GetControlPoints, (py::arg("out")=py::object()))
+    .def("GetRotations", &bs::CapsuleRope::py_GetRotations, (py::arg("out")=py::object()))
     .def("SetRotations", &bs::CapsuleRope::py_SetRotations)
-    .def("GetTranslations", &bs::CapsuleRope::py_GetTranslations)
+    .def("GetTranslations", &bs::CapsuleRope::py_GetTranslations, (py::arg("out")=py::object()))
     .def("SetTranslations", &bs::CapsuleRope::py_SetTranslations)
-    .def("GetHalfHeights", &bs::CapsuleRope::py_GetHalfHeights)
+    .def("GetHalfHeights", &bs::CapsuleRope::py_GetHalfHeights, (py::arg("out")=py::object()))
     ;
 
   py::scope().attr("sim_params") = bs::GetSimParams();
+  py::def("GetShapeCacheStats", &GetShapeCacheStats, "process-wide shape cache counters: a dict of memoryHits, diskHits and misses");
+  py::def("ClearShapeCache", &ClearShapeCache, "drops the shape cache's in-memory entries; files in sim_params.shapeCacheDir are kept");
+  py::scope().attr("STOP_ON_CONTACT") = (int) bs::BulletEnvironment::STOP_ON_CONTACT;
+  py::scope().attr("STOP_ON_NAN") = (int) bs::BulletEnvironment::STOP_ON_NAN;
+  py::scope().attr("TRIMESH_CONVEX_HULL") = (int) CONVEX_HULL;
+  py::scope().attr("TRIMESH_RAW") = (int) RAW;
+  py::scope().attr("TRIMESH_CONVEX_DECOMPOSITION") = (int) CONVEX_DECOMPOSITION;
 }
@@ -0,0 +1,74 @@
+#include "collision_checking.h"
+
+// one per concurrent query, configured like the world's. Small pools: a query only holds
+// one algorithm (and its manifolds) at a time, and the dispatcher falls back to the heap
+// if they run out
+struct ParallelContactTester::Context {
+  btSoftBodyRigidBodyCollisionConfiguration *configuration;
+  btCollisionDispatcher *dispatcher;
+
+  Context() {
+    btDefaultCollisionConstructionInfo info;
+    info.m_defaultMaxPersistentManifoldPoolSize = 64;
+    info.m_defaultMaxCollisionAlgorithmPoolSize = 64;
+    configuration = new btSoftBodyRigidBodyCollisionConfiguration(info);
+    dispatcher = new btCollisionDispatcher(configuration);
+  }
+  ~Context() {
+    delete dispatcher;
+    delete configuration;
+  }
+};
+
+ParallelContactTester::ParallelContactTester(BulletInstance::Ptr bullet) : m_bullet(bullet) { }
+
+ParallelContactTester::~ParallelContactTester() {
+  for (size_t i = 0; i < m_contexts.size(); ++i) delete m_contexts[i];
+}
+
+ParallelContactTester::Context *ParallelContactTester::acquire() {
+  boost::mutex::scoped_lock lock(m_mutex);
+  Context *context;
+  if (m_free.empty()) {
+    context = new Context();
+    m_contexts.push_back(context);
+  }
+  else {
+    context = m_free.back();
+    m_free.pop_back();
+  }
+  // same contact breaking rules as the world's dispatcher (e.g. after SetContactDistance),
+  // but the context's own small pools can always fall back to the heap
+  context->dispatcher->setDispatcherFlags(m_bullet->dispatcher->getDispatcherFlags()
+                                          & ~btCollisionDispatcher::CD_DISABLE_CONTACTPOOL_DYNAMIC_ALLOCATION);
+  return context;
+}
+
+void ParallelContactTester::release(Context *context) {
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_free.push_back(context);
+}
+
+bool ParallelContactTester::contactTestAny(btCollisionShape *shape, const btTransform &trans, const CollisionObjectMask &ignore) {
+  // a stand-in for the query object, which is never added to the world
+  btCollisionObject obj;
+  obj.setCollisionShape(shape);
+  obj.setWorldTransform(trans);
+
+  Context *context = acquire();
+  bool hit = m_bullet->contactTestAny(&obj, ignore, context->dispatcher);
+  release(context);
+  return hit;
+}
+
+bool ParallelContactTester::sweepTestAny(btCollisionShape *shape, const btTransform &from, const btTransform &to, const CollisionObjectMask &ignore) {
+  if (shape->isConvex())
+    return m_bullet->convexSweepTestAny(static_cast<btConvexShape *>(shape), from, to, ignore);
+  if (!shape->isCompound()) return false;
+  btCompoundShape *compound = static_cast<btCompoundShape *>(shape);
+  for (int i = 0; i < compound->getNumChildShapes(); ++i) {
+    const btTransform &child = compound->getChildTransform(i);
+    if (sweepTestAny(compound->getChildShape(i), from * child, to * child, ignore)) return true;
+  }
+  return false;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "environment.h"
+#include <boost/thread/mutex.hpp>
+#include <vector>
+
+// Runs contact queries against one Bullet world from several threads at once.
+// btCollisionWorld::contactTest isn't reentrant: algorithms and manifolds come from the
+// pools of the world's dispatcher, and the convex algorithms share one simplex solver.
+// Here each query borrows a dispatcher with its own collision configuration, so only the
+// broadphase and the collision objects of the world are shared, and only read.
+// The world must not be changed or stepped while queries are running.
+class ParallelContactTester {
+public:
+  typedef boost::shared_ptr<ParallelContactTester> Ptr;
+
+  explicit ParallelContactTester(BulletInstance::Ptr bullet);
+  ~ParallelContactTester();
+
+  // true if shape, placed at trans, touches anything in the world that isn't in ignore
+  // (see BulletInstance::contactTestAny). Thread safe.
+  bool contactTestAny(btCollisionShape *shape, const btTransform &trans, const CollisionObjectMask &ignore);
+
+  // true if shape hits anything not in ignore while moving from one transform to the other
+  // (see BulletInstance::convexSweepTestAny). Compound shapes are swept child by child;
+  // children that aren't convex (triangle meshes) can't be swept, and are skipped. Thread safe.
+  bool sweepTestAny(btCollisionShape *shape, const btTransform &from, const btTransform &to, const CollisionObjectMask &ignore);
+
+private:
+  ParallelContactTester(const ParallelContactTester &);
+  ParallelContactTester &operator=(const ParallelContactTester &);
+
+  struct Context;
+  Context *acquire();
+  void release(Context *context);
+
+  BulletInstance::Ptr m_bullet;
+  boost::mutex m_mutex;
+  std::vector<Context *> m_contexts; // all of them, for deletion
+  std::vector<Context *> m_free;
+};
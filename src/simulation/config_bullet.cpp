@@ -9,3 +9,12 @@ float BulletConfig::margin = .0005;
 float BulletConfig::linkPadding = 0;
 bool BulletConfig::graphicsMesh = false;
 int BulletConfig::kinematicPolicy = 1;
+int BulletConfig::numThreads = 1;
+int BulletConfig::solverType = 0;
+int BulletConfig::manifoldPoolSize = 16384;
+std::string BulletConfig::shapeCacheDir = "";
+int BulletConfig::trimeshMode = 0;
+int BulletConfig::hacdMinClusters = 2;
+int BulletConfig::hacdMaxVerticesPerHull = 100;
+float BulletConfig::hacdConcavity = 100;
+int BulletConfig::loadThreads = 0;
@@ -13,6 +13,15 @@ struct BulletConfig : Config {
   static float linkPadding;
   static bool graphicsMesh;
 	static int kinematicPolicy;
+  static int numThreads;
+  static int solverType;
+  static int manifoldPoolSize;
+  static std::string shapeCacheDir;
+  static int trimeshMode;
+  static int hacdMinClusters;
+  static int hacdMaxVerticesPerHull;
+  static float hacdConcavity;
+  static int loadThreads;
 
   BulletConfig() : Config() {
     params.push_back(new Parameter<float>("gravity", &gravity.m_floats[2], "gravity (z component)")); 
@@ -25,6 +34,15 @@ struct BulletConfig : Config {
     params.push_back(new Parameter<float>("linkPadding", &linkPadding, "expand links by that much if they're convex hull shapes"));
     params.push_back(new Parameter<bool>("graphicsMesh", &graphicsMesh, "visualize a high res graphics mesh"));
 		params.push_back(new Parameter<int>("kinematicPolicy", &kinematicPolicy, "0: nothing dynamic. 1: non-robot kinbodies dynamic 2: everything dynamic"));
+    params.push_back(new Parameter<int>("numThreads", &numThreads, "number of threads for the collision narrowphase (1: single-threaded)"));
+    params.push_back(new Parameter<int>("solverType", &solverType, "0: sequential impulse. 1: btParallelConstraintSolver on numThreads threads"));
+    params.push_back(new Parameter<int>("manifoldPoolSize", &manifoldPoolSize, "contact manifolds the parallel solver can hold; stepping fails with an error beyond that, leaving the environment unusable"));
+    params.push_back(new Parameter<std::string>("shapeCacheDir", &shapeCacheDir, "directory for cached convex hulls, decompositions and BVHs (empty: cache in memory only)"));
+    params.push_back(new Parameter<int>("trimeshMode", &trimeshMode, "triangle meshes as 0: convex hull. 1: raw mesh. 2: convex decomposition (HACD)"));
+    params.push_back(new Parameter<int>("hacdMinClusters", &hacdMinClusters, "convex decomposition: minimum number of pieces"));
+    params.push_back(new Parameter<int>("hacdMaxVerticesPerHull", &hacdMaxVerticesPerHull, "convex decomposition: maximum vertices per piece"));
+    params.push_back(new Parameter<float>("hacdConcavity", &hacdConcavity, "convex decomposition: maximum concavity of a piece"));
+    params.push_back(new Parameter<int>("loadThreads", &loadThreads, "threads building link shapes when loading from OpenRAVE (0: one per core, 1: single-threaded)"));
   }
 };
 
@@ -1,14 +1,105 @@
 #include "environment.h"
 #include "openravesupport.h"
 #include "config_bullet.h"
+#include "logging.h"
+#include <BulletMultiThreaded/PosixThreadSupport.h>
+#include <BulletMultiThreaded/SpuGatheringCollisionDispatcher.h>
+#include <BulletMultiThreaded/SpuNarrowPhaseCollisionTask/SpuGatheringCollisionTask.h>
+#include <BulletMultiThreaded/btParallelConstraintSolver.h>
+#include <BulletCollision/CollisionDispatch/btSimulationIslandManager.h>
+#include <BulletCollision/CollisionShapes/btTriangleShape.h>
+#include <BulletCollision/NarrowPhaseCollision/btGjkPairDetector.h>
+#include <BulletCollision/NarrowPhaseCollision/btGjkEpaPenetrationDepthSolver.h>
+#include <BulletCollision/NarrowPhaseCollision/btPointCollector.h>
+#include <BulletSoftBody/btSoftBody.h>
+#include <LinearMath/btPoolAllocator.h>
+#include <boost/format.hpp>
 
-BulletInstance::BulletInstance() {
+static btThreadSupportInterface *createCollisionThreadSupport(int numThreads) {
+#ifdef USE_PTHREADS
+    PosixThreadSupport::ThreadConstructionInfo info("collision",
+        processCollisionTask, createCollisionLocalStoreMemory, numThreads);
+    return new PosixThreadSupport(info);
+#else
+    LOG_WARN("no thread support for the narrowphase on this platform, running single-threaded");
+    return NULL;
+#endif
+}
+
+static btThreadSupportInterface *createSolverThreadSupport(int numThreads) {
+#ifdef USE_PTHREADS
+    PosixThreadSupport::ThreadConstructionInfo info("solver",
+        SolverThreadFunc, SolverlsMemoryFunc, numThreads);
+    return new PosixThreadSupport(info);
+#else
+    LOG_WARN("no thread support for the parallel solver on this platform, using the sequential impulse solver");
+    return NULL;
+#endif
+}
+
+// The parallel solver needs every manifold in the dispatcher's contiguous pool. Bullet
+// returns a null manifold once that pool is exhausted and then crashes constructing into
+// it, so throw instead and point at the setting that sizes the pool. The throw comes from
+// inside stepSimulation, which leaves the world half stepped (some pairs without their
+// algorithms, the substep unfinished): the environment can't be used afterwards.
+template <class Dispatcher>
+class PoolCheckedDispatcher : public Dispatcher {
+public:
+    PoolCheckedDispatcher(btCollisionConfiguration *configuration) : Dispatcher(configuration) { }
+    PoolCheckedDispatcher(btThreadSupportInterface *threads, int maxNumOutstandingTasks, btCollisionConfiguration *configuration) :
+        Dispatcher(threads, maxNumOutstandingTasks, configuration) { }
+
+    btPersistentManifold *getNewManifold(void *b0, void *b1) {
+        if ((this->getDispatcherFlags() & btCollisionDispatcher::CD_DISABLE_CONTACTPOOL_DYNAMIC_ALLOCATION)
+                && this->getInternalManifoldPool()->getFreeCount() == 0)
+            throw std::runtime_error((boost::format("contact manifold pool full (%d manifolds); increase BulletConfig::manifoldPoolSize. "
+                "The environment was left half stepped and must be discarded")
+                % this->getInternalManifoldPool()->getMaxCount()).str());
+        return Dispatcher::getNewManifold(b0, b1);
+    }
+};
+
+BulletInstance::BulletInstance() :
+    numThreads(BulletConfig::numThreads), solverType((SolverType) BulletConfig::solverType) {
+    init();
+}
+
+BulletInstance::BulletInstance(int numThreads_, SolverType solverType_) :
+    numThreads(numThreads_), solverType(solverType_) {
+    init();
+}
+
+void BulletInstance::init() {
   broadphase = new btDbvtBroadphase();
   //    broadphase = new btAxisSweep3(btVector3(-2*METERS, -2*METERS, -1*METERS), btVector3(2*METERS, 2*METERS, 3*METERS));
-    collisionConfiguration = new btSoftBodyRigidBodyCollisionConfiguration();
-    dispatcher = new btCollisionDispatcher(collisionConfiguration);
-    solver = new btSequentialImpulseConstraintSolver;
-    dynamicsWorld = new btSoftRigidDynamicsWorld(dispatcher, broadphase, solver, collisionConfiguration);
+    solverThreads = solverType == PARALLEL ? createSolverThreadSupport(std::max(numThreads, 1)) : NULL;
+    btDefaultCollisionConstructionInfo constructionInfo;
+    if (solverThreads)
+        constructionInfo.m_defaultMaxPersistentManifoldPoolSize = BulletConfig::manifoldPoolSize;
+    collisionConfiguration = new btSoftBodyRigidBodyCollisionConfiguration(constructionInfo);
+    collisionThreads = numThreads > 1 ? createCollisionThreadSupport(numThreads) : NULL;
+    if (collisionThreads)
+        dispatcher = new PoolCheckedDispatcher<SpuGatheringCollisionDispatcher>(collisionThreads, numThreads, collisionConfiguration);
+    else {
+        numThreads = 1;
+        dispatcher = new PoolCheckedDispatcher<btCollisionDispatcher>(collisionConfiguration);
+    }
+    if (solverThreads) {
+        solver = new btParallelConstraintSolver(solverThreads);
+        // the parallel solver needs all manifolds in the dispatcher's contiguous pool
+        dispatcher->setDispatcherFlags(dispatcher->getDispatcherFlags() | btCollisionDispatcher::CD_DISABLE_CONTACTPOOL_DYNAMIC_ALLOCATION);
+    }
+    else {
+        solverType = SEQUENTIAL_IMPULSE;
+        solver = new btSequentialImpulseConstraintSolver;
+    }
+    profiler.reset(new StepProfiler());
+    dynamicsWorld = new ProfiledDynamicsWorld(dispatcher, broadphase, solver, collisionConfiguration, profiler.get());
+    broadphase->getOverlappingPairCache()->setOverlapFilterCallback(&pairFilter);
+    // btParallelConstraintSolver batches the whole world itself
+    if (solverType == PARALLEL)
+        dynamicsWorld->getSimulationIslandManager()->setSplitIslands(false);
+    // only has an effect with the SpuGatheringCollisionDispatcher
     dynamicsWorld->getDispatchInfo().m_enableSPU = true;
 
     softBodyWorldInfo = &dynamicsWorld->getWorldInfo();
@@ -16,13 +107,23 @@ BulletInstance::BulletInstance() {
     softBodyWorldInfo->m_dispatcher = dispatcher;
     softBodyWorldInfo->m_sparsesdf.Initialize();
     setDefaultGravity();
-        
+
+    m_initDispatcherFlags = dispatcher->getDispatcherFlags();
+    m_initSolverInfo = dynamicsWorld->getSolverInfo();
+    m_initDispatchInfo = dynamicsWorld->getDispatchInfo();
+    m_initSoftBodyWorldInfo.air_density = softBodyWorldInfo->air_density;
+    m_initSoftBodyWorldInfo.water_density = softBodyWorldInfo->water_density;
+    m_initSoftBodyWorldInfo.water_offset = softBodyWorldInfo->water_offset;
+    m_initSoftBodyWorldInfo.water_normal = softBodyWorldInfo->water_normal;
 }
 
 BulletInstance::~BulletInstance() {
     delete dynamicsWorld;
     delete solver;
+    delete solverThreads;
     delete dispatcher;
+    // the dispatcher's task process still talks to the threads when it's deleted
+    delete collisionThreads;
     delete collisionConfiguration;
     delete broadphase;
 }
@@ -36,25 +137,511 @@ void BulletInstance::setDefaultGravity() {
   setGravity(BulletConfig::gravity * METERS);
 }
 
+void BulletInstance::reset() {
+    // whoever created these objects still owns them, we only take them out of the world
+    for (int i = dynamicsWorld->getNumConstraints() - 1; i >= 0; --i)
+        dynamicsWorld->removeConstraint(dynamicsWorld->getConstraint(i));
+    btCollisionObjectArray &objs = dynamicsWorld->getCollisionObjectArray();
+    if (objs.size() > 0)
+        LOG_DEBUG("resetting BulletInstance with " << objs.size() << " objects left in the world");
+    while (objs.size() > 0) {
+        btCollisionObject *obj = objs[objs.size() - 1];
+        if (btSoftBody *psb = btSoftBody::upcast(obj))
+            dynamicsWorld->removeSoftBody(psb);
+        else if (btRigidBody *body = btRigidBody::upcast(obj))
+            dynamicsWorld->removeRigidBody(body);
+        else
+            dynamicsWorld->removeCollisionObject(obj);
+    }
+
+    // with no proxies left this only resets the tree bookkeeping,
+    // so that proxy ids (and therefore pair order) match those of a new broadphase
+    broadphase->resetPool(dispatcher);
+    // cells are keyed by shape pointer, which can be reused by the next owner
+    softBodyWorldInfo->m_sparsesdf.Reset();
+    pairFilter.clear();
+    solver->reset();
+    setDefaultGravity();
+    profiler->reset();
+
+    // the previous owner may have changed these (e.g. SetContactDistance clears
+    // CD_USE_RELATIVE_CONTACT_BREAKING_THRESHOLD)
+    static_cast<ProfiledDynamicsWorld *>(dynamicsWorld)->setLocalTime(0);
+    dispatcher->setDispatcherFlags(m_initDispatcherFlags);
+    dynamicsWorld->getSolverInfo() = m_initSolverInfo;
+    dynamicsWorld->getDispatchInfo() = m_initDispatchInfo;
+    softBodyWorldInfo->air_density = m_initSoftBodyWorldInfo.air_density;
+    softBodyWorldInfo->water_density = m_initSoftBodyWorldInfo.water_density;
+    softBodyWorldInfo->water_offset = m_initSoftBodyWorldInfo.water_offset;
+    softBodyWorldInfo->water_normal = m_initSoftBodyWorldInfo.water_normal;
+}
+
+void BulletInstance::disableCollision(btCollisionObject *a, btCollisionObject *b) {
+    pairFilter.disable(a, b);
+    btBroadphaseProxy *pa = a->getBroadphaseHandle(), *pb = b->getBroadphaseHandle();
+    if (pa && pb)
+        broadphase->getOverlappingPairCache()->removeOverlappingPair(pa, pb, dispatcher);
+}
+
+void BulletInstance::enableCollision(btCollisionObject *a, btCollisionObject *b) {
+    if (!pairFilter.enable(a, b)) return;
+    // the broadphase only looks for new pairs when objects move
+    btBroadphaseProxy *pa = a->getBroadphaseHandle(), *pb = b->getBroadphaseHandle();
+    btOverlappingPairCache *pairs = broadphase->getOverlappingPairCache();
+    if (pa && pb && TestAabbAgainstAabb2(pa->m_aabbMin, pa->m_aabbMax, pb->m_aabbMin, pb->m_aabbMax)
+        && !pairs->findPair(pa, pb))
+        pairs->addOverlappingPair(pa, pb);
+}
+
+int CollisionPairFilter::indexOf(const btCollisionObject *obj) const {
+    boost::unordered_map<const btCollisionObject *, int>::const_iterator i = m_indices.find(obj);
+    return i == m_indices.end() ? -1 : i->second;
+}
+
+int CollisionPairFilter::addIndex(const btCollisionObject *obj) {
+    int i = indexOf(obj);
+    if (i >= 0) return i;
+    if (!m_free.empty()) {
+        // a released index has no pairs left, so its row is already clear
+        i = m_free.back();
+        m_free.pop_back();
+        m_objects[i] = obj;
+    } else {
+        i = m_objects.size();
+        m_objects.push_back(obj);
+        m_numPairs.push_back(0);
+    }
+    m_indices[obj] = i;
+    if (i >= m_size) {
+        // grow the matrix, keeping the pairs
+        int size = std::max(2*m_size, 16);
+        std::vector<bool> bits(size*size, false);
+        for (std::map<std::pair<int, int>, int>::const_iterator p = m_counts.begin(); p != m_counts.end(); ++p)
+            bits[p->first.first*size + p->first.second] = bits[p->first.second*size + p->first.first] = true;
+        m_bits.swap(bits);
+        m_size = size;
+    }
+    return i;
+}
+
+void CollisionPairFilter::releaseIndex(int i) {
+    m_indices.erase(m_objects[i]);
+    m_objects[i] = NULL;
+    m_free.push_back(i);
+}
+
+void CollisionPairFilter::disable(const btCollisionObject *a, const btCollisionObject *b) {
+    int i = addIndex(a), j = addIndex(b);
+    if (++m_counts[std::make_pair(std::min(i, j), std::max(i, j))] == 1) {
+        m_bits[i*m_size + j] = m_bits[j*m_size + i] = true;
+        ++m_numPairs[i];
+        if (j != i) ++m_numPairs[j];
+    }
+}
+
+bool CollisionPairFilter::enable(const btCollisionObject *a, const btCollisionObject *b) {
+    int i = indexOf(a), j = indexOf(b);
+    if (i < 0 || j < 0) return false;
+    std::map<std::pair<int, int>, int>::iterator p = m_counts.find(std::make_pair(std::min(i, j), std::max(i, j)));
+    if (p == m_counts.end()) return false;
+    if (--p->second > 0) return false;
+    m_counts.erase(p);
+    m_bits[i*m_size + j] = m_bits[j*m_size + i] = false;
+    if (--m_numPairs[i] == 0) releaseIndex(i);
+    if (j != i && --m_numPairs[j] == 0) releaseIndex(j);
+    return true;
+}
+
+bool CollisionPairFilter::isDisabled(const btCollisionObject *a, const btCollisionObject *b) const {
+    if (m_counts.empty()) return false;
+    int i = indexOf(a), j = indexOf(b);
+    return i >= 0 && j >= 0 && m_bits[i*m_size + j];
+}
+
+void CollisionPairFilter::clear() {
+    m_indices.clear();
+    m_objects.clear();
+    m_numPairs.clear();
+    m_free.clear();
+    m_counts.clear();
+    m_bits.clear();
+    m_size = 0;
+}
+
+bool CollisionPairFilter::needBroadphaseCollision(btBroadphaseProxy *proxy0, btBroadphaseProxy *proxy1) const {
+    // what btHashedOverlappingPairCache does without a filter
+    if (!(proxy0->m_collisionFilterGroup & proxy1->m_collisionFilterMask)
+        || !(proxy1->m_collisionFilterGroup & proxy0->m_collisionFilterMask))
+        return false;
+    return !isDisabled((const btCollisionObject *) proxy0->m_clientObject, (const btCollisionObject *) proxy1->m_clientObject);
+}
+
+BulletInstancePool::~BulletInstancePool() {
+    clear();
+}
+
+BulletInstance::Ptr BulletInstancePool::acquire() {
+    BulletInstance *bullet = NULL;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (!m_free.empty()) {
+            bullet = m_free.back();
+            m_free.pop_back();
+        }
+    }
+    if (!bullet)
+        bullet = new BulletInstance();
+    return BulletInstance::Ptr(bullet, Recycler(shared_from_this()));
+}
+
+int BulletInstancePool::numFree() {
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_free.size();
+}
+
+void BulletInstancePool::clear() {
+    std::vector<BulletInstance *> instances;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        instances.swap(m_free);
+    }
+    for (int i = 0; i < instances.size(); ++i)
+        delete instances[i];
+}
+
+void BulletInstancePool::release(BulletInstance *bullet) {
+    bullet->reset();
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (m_maxFree <= 0 || m_free.size() < m_maxFree) {
+            m_free.push_back(bullet);
+            return;
+        }
+    }
+    delete bullet;
+}
+
+void BulletInstancePool::Recycler::operator()(BulletInstance *bullet) {
+    if (BulletInstancePool::Ptr p = pool.lock())
+        p->release(bullet);
+    else
+        delete bullet;
+}
+
+btScalar BulletInstance::contactBreakingThreshold(const btCollisionObject *a, const btCollisionObject *b) const {
+    if (!(dispatcher->getDispatcherFlags() & btCollisionDispatcher::CD_USE_RELATIVE_CONTACT_BREAKING_THRESHOLD))
+        return gContactBreakingThreshold;
+    return btMin(a->getCollisionShape()->getContactBreakingThreshold(gContactBreakingThreshold),
+                 b->getCollisionShape()->getContactBreakingThreshold(gContactBreakingThreshold));
+}
+
 void BulletInstance::contactTest(btCollisionObject *obj,
                                 BulletInstance::CollisionObjectSet &out,
                                 const BulletInstance::CollisionObjectSet *ignore) {
     struct ContactCallback : public btCollisionWorld::ContactResultCallback {
+        const BulletInstance &bullet;
         const CollisionObjectSet *ignore;
         CollisionObjectSet &out;
-        ContactCallback(const CollisionObjectSet *ignore_, CollisionObjectSet &out_) :
-            ignore(ignore_), out(out_) { }
-        btScalar addSingleResult(btManifoldPoint &,
+        ContactCallback(const BulletInstance &bullet_, const CollisionObjectSet *ignore_, CollisionObjectSet &out_) :
+            bullet(bullet_), ignore(ignore_), out(out_) { }
+        btScalar addSingleResult(btManifoldPoint &pt,
                                  const btCollisionObject *colObj0, int, int,
                                  const btCollisionObject *colObj1, int, int) {
-            if (ignore && ignore->find(colObj1) == ignore->end())
+            if (pt.getDistance() > bullet.contactBreakingThreshold(colObj0, colObj1)) return 0;
+            if (!ignore || ignore->find(colObj1) == ignore->end())
                 out.insert(colObj1);
             return 0;
         }
-    } cb(ignore, out);
+    } cb(*this, ignore, out);
     dynamicsWorld->contactTest(obj, cb);
 }
 
+// the filter of a default ContactResultCallback, which contactTest uses
+static bool passesDefaultFilter(const btBroadphaseProxy *proxy) {
+    return (proxy->m_collisionFilterGroup & btBroadphaseProxy::AllFilter)
+        && (proxy->m_collisionFilterMask & btBroadphaseProxy::DefaultFilter);
+}
+
+// The compound and concave algorithms temporarily swap the shape and transform of the
+// objects they're given, so a world object is never passed to them directly: other
+// queries may be reading it at the same time. This copies what they read.
+static void makeStandIn(const btCollisionObject *target, btCollisionObject &standIn) {
+    standIn.setCollisionShape(const_cast<btCollisionShape *>(target->getCollisionShape()));
+    standIn.setWorldTransform(target->getWorldTransform());
+    standIn.setInterpolationWorldTransform(target->getInterpolationWorldTransform());
+    standIn.setContactProcessingThreshold(target->getContactProcessingThreshold());
+}
+
+// narrowphase only, recording whether there's a contact point. Points beyond the contact
+// breaking threshold are dropped, as btManifoldResult does, so this agrees with contactTest
+static bool touches(btCollisionObject *obj, btCollisionObject *other, btDispatcher *dispatcher, const btDispatcherInfo &info) {
+    struct AnyContactResult : public btManifoldResult {
+        bool hit;
+        AnyContactResult(btCollisionObject *obj0, btCollisionObject *obj1) :
+            btManifoldResult(obj0, obj1), hit(false) { }
+        void addContactPoint(const btVector3 &, const btVector3 &, btScalar depth) {
+            if (m_manifoldPtr && depth > m_manifoldPtr->getContactBreakingThreshold()) return;
+            hit = true;
+        }
+    };
+    btCollisionAlgorithm *algorithm = dispatcher->findAlgorithm(obj, other);
+    if (!algorithm) return false;
+    AnyContactResult result(obj, other);
+    algorithm->processCollision(obj, other, info, &result);
+    algorithm->~btCollisionAlgorithm();
+    dispatcher->freeCollisionAlgorithm(algorithm);
+    return result.hit;
+}
+
+// Soft bodies can't be given to touches(): their collision algorithms cast both objects
+// to btSoftBody and record the contacts in the soft body for its next step. Like the soft
+// body's own rigid collisions, test its nodes as spheres of the body's margin instead,
+// skipping those outside [aabbMin, aabbMax] (obj's AABB)
+static bool touchesSoftBody(btCollisionObject *obj, const btSoftBody *soft, const btVector3 &aabbMin, const btVector3 &aabbMax,
+                            btDispatcher *dispatcher, const btDispatcherInfo &info) {
+    btScalar margin = soft->getCollisionShape()->getMargin();
+    btVector3 padding(margin, margin, margin);
+    btSphereShape sphere(margin);
+    btCollisionObject node;
+    node.setCollisionShape(&sphere);
+    btTransform trans;
+    trans.setIdentity();
+    for (int i = 0; i < soft->m_nodes.size(); ++i) {
+        const btVector3 &x = soft->m_nodes[i].m_x;
+        if (!TestPointAgainstAabb2(aabbMin - padding, aabbMax + padding, x)) continue;
+        trans.setOrigin(x);
+        node.setWorldTransform(trans);
+        if (touches(obj, &node, dispatcher, info)) return true;
+    }
+    return false;
+}
+
+bool BulletInstance::contactPairTestAny(btCollisionObject *a, btCollisionObject *b) {
+    return touches(a, b, dispatcher, dynamicsWorld->getDispatchInfo());
+}
+
+bool BulletInstance::contactTestAny(btCollisionObject *obj, const CollisionObjectMask &ignore, btDispatcher *dispatcher) {
+    // same as btCollisionWorld::contactTest, minus the per-point callbacks
+    struct AnyContactTest : public btBroadphaseAabbCallback {
+        btCollisionObject *obj;
+        btCollisionWorld *world;
+        btDispatcher *dispatcher;
+        const CollisionObjectMask &ignore;
+        const CollisionPairFilter &filter;
+        btVector3 aabbMin, aabbMax;
+        bool hit;
+        AnyContactTest(btCollisionObject *obj_, btCollisionWorld *world_, btDispatcher *dispatcher_, const CollisionObjectMask &ignore_,
+                       const CollisionPairFilter &filter_) :
+            obj(obj_), world(world_), dispatcher(dispatcher_), ignore(ignore_), filter(filter_), hit(false) {
+            obj->getCollisionShape()->getAabb(obj->getWorldTransform(), aabbMin, aabbMax);
+        }
+        bool process(const btBroadphaseProxy *proxy) {
+            // the broadphase can't be stopped, but the remaining candidates are skipped
+            const btBroadphaseProxy *handle = obj->getBroadphaseHandle();
+            if (hit || proxy == handle || ignore.contains(proxy)) return true;
+            const btCollisionObject *target = (const btCollisionObject *) proxy->m_clientObject;
+            if (!passesDefaultFilter(proxy) || filter.isDisabled(obj, target)) return true;
+            if (const btSoftBody *soft = btSoftBody::upcast(target)) {
+                hit = touchesSoftBody(obj, soft, aabbMin, aabbMax, dispatcher, world->getDispatchInfo());
+                return true;
+            }
+            btCollisionObject other;
+            makeStandIn(target, other);
+            hit = touches(obj, &other, dispatcher, world->getDispatchInfo());
+            return true;
+        }
+    } test(obj, dynamicsWorld, dispatcher ? dispatcher : dynamicsWorld->getDispatcher(), ignore, pairFilter);
+
+    broadphase->aabbTest(test.aabbMin, test.aabbMax, test);
+    return test.hit;
+}
+
+bool BulletInstance::convexSweepTestAny(const btConvexShape *shape, const btTransform &from, const btTransform &to,
+                                        const CollisionObjectMask &ignore) {
+    // only records whether the cast hit anything
+    struct AnyConvexResult : public btCollisionWorld::ConvexResultCallback {
+        bool hit;
+        AnyConvexResult() : hit(false) { }
+        btScalar addSingleResult(btCollisionWorld::LocalConvexResult &result, bool) {
+            hit = true;
+            return m_closestHitFraction = result.m_hitFraction;
+        }
+    };
+    // like convexSweepTest, but the broadphase is queried with the AABB of the whole
+    // sweep: its rayTest keeps a stack in the broadphase, and can't run concurrently
+    struct AnySweepTest : public btBroadphaseAabbCallback {
+        const btConvexShape *shape;
+        const btTransform &from, &to;
+        const CollisionObjectMask &ignore;
+        AnyConvexResult result;
+        AnySweepTest(const btConvexShape *shape_, const btTransform &from_, const btTransform &to_, const CollisionObjectMask &ignore_) :
+            shape(shape_), from(from_), to(to_), ignore(ignore_) { }
+        bool process(const btBroadphaseProxy *proxy) {
+            if (result.hit || ignore.contains(proxy) || !passesDefaultFilter(proxy)) return true;
+            btCollisionObject other;
+            makeStandIn((const btCollisionObject *) proxy->m_clientObject, other);
+            btCollisionWorld::objectQuerySingle(shape, from, to, &other, other.getCollisionShape(),
+                                                other.getWorldTransform(), result, 0);
+            return true;
+        }
+    } test(shape, from, to, ignore);
+
+    // the shape's AABB over its rotation, at both ends of the translation
+    btVector3 linVel, angVel, zero(0, 0, 0), aabbMin, aabbMax;
+    btTransformUtil::calculateVelocity(from, to, 1, linVel, angVel);
+    btTransform rotation(from.getBasis());
+    shape->calculateTemporalAabb(rotation, zero, angVel, 1, aabbMin, aabbMax);
+    btVector3 sweepMin = aabbMin + from.getOrigin(), sweepMax = aabbMax + from.getOrigin();
+    sweepMin.setMin(aabbMin + to.getOrigin());
+    sweepMax.setMax(aabbMax + to.getOrigin());
+    broadphase->aabbTest(sweepMin, sweepMax, test);
+    return test.result.hit;
+}
+
+namespace {
+// closest points between the parts of two shapes, for distanceTest. Shape a always
+// belongs to objA; b to objB
+struct PartDistances {
+    const btCollisionObject *objA, *objB;
+    btScalar maxDist;
+    std::vector<DistanceResult> &out;
+
+    static bool convexDistance(const btConvexShape *a, const btTransform &ta, const btConvexShape *b, const btTransform &tb,
+                               btPointCollector &result) {
+        btVoronoiSimplexSolver simplex;
+        btGjkEpaPenetrationDepthSolver epa;
+        btGjkPairDetector gjk(a, b, &simplex, &epa);
+        btGjkPairDetector::ClosestPointInput input;
+        input.m_transformA = ta;
+        input.m_transformB = tb;
+        gjk.getClosestPoints(input, result, NULL);
+        return result.m_hasResult;
+    }
+
+    // result is from GJK between a part of B and a part of A if flipped
+    void add(const btPointCollector &result, bool flipped) {
+        if (result.m_distance > maxDist) return;
+        DistanceResult r = {objA, objB};
+        btVector3 onSecond = result.m_pointInWorld, onFirst = onSecond + result.m_normalOnBInWorld*result.m_distance;
+        r.ptA = flipped ? onSecond : onFirst;
+        r.ptB = flipped ? onFirst : onSecond;
+        r.normalB2A = flipped ? -result.m_normalOnBInWorld : result.m_normalOnBInWorld;
+        r.distance = result.m_distance;
+        out.push_back(r);
+    }
+
+    bool near(const btCollisionShape *a, const btTransform &ta, const btCollisionShape *b, const btTransform &tb) const {
+        btVector3 minA, maxA, minB, maxB;
+        a->getAabb(ta, minA, maxA);
+        b->getAabb(tb, minB, maxB);
+        btVector3 grow(maxDist, maxDist, maxDist);
+        return TestAabbAgainstAabb2(minA - grow, maxA + grow, minB, maxB);
+    }
+
+    // the closest triangle of the mesh, like btConvexConcaveCollisionAlgorithm
+    void convexConcave(const btConvexShape *convex, const btTransform &tc, const btConcaveShape *concave, const btTransform &tm,
+                       bool flipped) {
+        struct ClosestTriangle : public btTriangleCallback {
+            const btConvexShape *convex;
+            const btTransform &tc, &tm;
+            btScalar margin;
+            btPointCollector best;
+            ClosestTriangle(const btConvexShape *convex_, const btTransform &tc_, const btTransform &tm_, btScalar margin_) :
+                convex(convex_), tc(tc_), tm(tm_), margin(margin_) { }
+            void processTriangle(btVector3 *triangle, int, int) {
+                btTriangleShape shape(triangle[0], triangle[1], triangle[2]);
+                shape.setMargin(margin);
+                btPointCollector result;
+                if (convexDistance(convex, tc, &shape, tm, result) && (!best.m_hasResult || result.m_distance < best.m_distance))
+                    best = result;
+            }
+        } closest(convex, tc, tm, concave->getMargin());
+        btVector3 aabbMin, aabbMax, grow(maxDist, maxDist, maxDist);
+        convex->getAabb(tm.inverseTimes(tc), aabbMin, aabbMax);
+        concave->processAllTriangles(&closest, aabbMin - grow, aabbMax + grow);
+        if (closest.best.m_hasResult) add(closest.best, flipped);
+    }
+
+    void compute(const btCollisionShape *a, const btTransform &ta, const btCollisionShape *b, const btTransform &tb) {
+        if (a->isCompound()) {
+            const btCompoundShape *compound = static_cast<const btCompoundShape *>(a);
+            for (int i = 0; i < compound->getNumChildShapes(); ++i) {
+                btTransform child = ta * compound->getChildTransform(i);
+                if (near(compound->getChildShape(i), child, b, tb)) compute(compound->getChildShape(i), child, b, tb);
+            }
+        } else if (b->isCompound()) {
+            const btCompoundShape *compound = static_cast<const btCompoundShape *>(b);
+            for (int i = 0; i < compound->getNumChildShapes(); ++i) {
+                btTransform child = tb * compound->getChildTransform(i);
+                if (near(a, ta, compound->getChildShape(i), child)) compute(a, ta, compound->getChildShape(i), child);
+            }
+        } else if (a->isConvex() && b->isConvex()) {
+            btPointCollector result;
+            if (convexDistance(static_cast<const btConvexShape *>(a), ta, static_cast<const btConvexShape *>(b), tb, result))
+                add(result, false);
+        } else if (a->isConvex() && b->isConcave()) {
+            convexConcave(static_cast<const btConvexShape *>(a), ta, static_cast<const btConcaveShape *>(b), tb, false);
+        } else if (a->isConcave() && b->isConvex()) {
+            convexConcave(static_cast<const btConvexShape *>(b), tb, static_cast<const btConcaveShape *>(a), ta, true);
+        }
+        // mesh against mesh isn't supported, as in the dispatcher
+    }
+};
+}
+
+void BulletInstance::distanceTest(btCollisionObject *obj, btScalar maxDist, const CollisionObjectMask &ignore,
+                                  std::vector<DistanceResult> &out) {
+    struct Candidates : public btBroadphaseAabbCallback {
+        const btCollisionObject *obj;
+        const CollisionObjectMask &ignore;
+        const CollisionPairFilter &filter;
+        std::vector<const btCollisionObject *> objs;
+        Candidates(const btCollisionObject *obj_, const CollisionObjectMask &ignore_, const CollisionPairFilter &filter_) :
+            obj(obj_), ignore(ignore_), filter(filter_) { }
+        bool process(const btBroadphaseProxy *proxy) {
+            const btCollisionObject *other = (const btCollisionObject *) proxy->m_clientObject;
+            if (other != obj && !ignore.contains(proxy) && passesDefaultFilter(proxy) && !filter.isDisabled(obj, other))
+                objs.push_back(other);
+            return true;
+        }
+    } candidates(obj, ignore, pairFilter);
+
+    btVector3 aabbMin, aabbMax, grow(maxDist, maxDist, maxDist);
+    obj->getCollisionShape()->getAabb(obj->getWorldTransform(), aabbMin, aabbMax);
+    broadphase->aabbTest(aabbMin - grow, aabbMax + grow, candidates);
+
+    for (size_t i = 0; i < candidates.objs.size(); ++i) {
+        const btCollisionObject *other = candidates.objs[i];
+        PartDistances parts = {obj, other, maxDist, out};
+        parts.compute(obj->getCollisionShape(), obj->getWorldTransform(), other->getCollisionShape(), other->getWorldTransform());
+    }
+}
+
+void CollisionObjectMask::insert(const btCollisionObject *obj) {
+    if (!obj) return;
+    objects.push_back(obj);
+    ids.push_back(-1);
+    stale = true;
+}
+
+void CollisionObjectMask::update() {
+    // cheap check first: the mask only changes when proxies do
+    for (size_t i = 0; i < objects.size() && !stale; ++i) {
+        const btBroadphaseProxy *proxy = objects[i]->getBroadphaseHandle();
+        stale = ids[i] != (proxy ? proxy->m_uniqueId : -1);
+    }
+    if (!stale) return;
+    bits.assign(bits.size(), false);
+    for (size_t i = 0; i < objects.size(); ++i) {
+        const btBroadphaseProxy *proxy = objects[i]->getBroadphaseHandle();
+        ids[i] = proxy ? proxy->m_uniqueId : -1;
+        if (ids[i] < 0) continue;
+        if (ids[i] >= (int) bits.size()) bits.resize(ids[i] + 1, false);
+        bits[ids[i]] = true;
+    }
+    stale = false;
+}
+
 Environment::~Environment() {
     for (ConstraintList::iterator i = constraints.begin(); i != constraints.end(); ++i)
         (*i)->destroy();
@@ -68,11 +655,22 @@ void Environment::add(EnvironmentObject::Ptr obj) {
     objects.push_back(obj);
     // objects are reponsible for adding themselves
     // to the dynamics world and the osg root
+
+    std::string name = obj->getName();
+    if (!name.empty()) objectsByName[name] = obj;
+    int id = obj->getId();
+    if (id > 0) objectsById[id] = obj;
 }
 
 void Environment::remove(EnvironmentObject::Ptr obj) {
     for (ObjectList::iterator i = objects.begin(); i != objects.end(); ++i) {
         if (obj == *i) {
+            // only drop index entries that still point to this object
+            NameIndex::iterator n = objectsByName.find(obj->getName());
+            if (n != objectsByName.end() && n->second == obj) objectsByName.erase(n);
+            IdIndex::iterator d = objectsById.find(obj->getId());
+            if (d != objectsById.end() && d->second == obj) objectsById.erase(d);
+
             (*i)->destroy();
             objects.erase(i);
             return;
@@ -80,6 +678,16 @@ void Environment::remove(EnvironmentObject::Ptr obj) {
     }
 }
 
+EnvironmentObject::Ptr Environment::getObjectByName(const std::string &name) const {
+    NameIndex::const_iterator i = objectsByName.find(name);
+    return i == objectsByName.end() ? EnvironmentObject::Ptr() : i->second;
+}
+
+EnvironmentObject::Ptr Environment::getObjectById(int id) const {
+    IdIndex::const_iterator i = objectsById.find(id);
+    return i == objectsById.end() ? EnvironmentObject::Ptr() : i->second;
+}
+
 void Environment::addConstraint(EnvironmentObject::Ptr cnt) {
     cnt->setEnvironment(this);
     cnt->init();
@@ -97,13 +705,180 @@ void Environment::removeConstraint(EnvironmentObject::Ptr cnt) {
 }
 
 void Environment::step(btScalar dt, int maxSubSteps, btScalar fixedTimeStep) {
-    ObjectList::iterator i;
-    for (i = objects.begin(); i != objects.end(); ++i)
-        (*i)->prePhysics();
+    StepProfiler *profiler = bullet->profiler.get();
+    profiler->beginStep();
+    {
+      ScopedPhaseTimer t(profiler, StepProfiler::PRE_PHYSICS);
+      ObjectList::iterator i;
+      for (i = objects.begin(); i != objects.end(); ++i)
+          (*i)->prePhysics();
+    }
     if (dt > 0) {
-      bullet->dynamicsWorld->stepSimulation(dt, maxSubSteps, fixedTimeStep);
+      int substeps = bullet->dynamicsWorld->stepSimulation(dt, maxSubSteps, fixedTimeStep);
+      ScopedPhaseTimer t(profiler, StepProfiler::SDF_GC);
       bullet->softBodyWorldInfo->m_sparsesdf.GarbageCollect();
+      profiler->setCount(StepProfiler::SUBSTEPS, substeps);
+    }
+    if (profiler->enabled) {
+      btDispatcher *dispatcher = bullet->dispatcher;
+      int contacts = 0;
+      for (int j = 0; j < dispatcher->getNumManifolds(); ++j)
+          contacts += dispatcher->getManifoldByIndexInternal(j)->getNumContacts();
+      profiler->setCount(StepProfiler::OVERLAPPING_PAIRS, bullet->broadphase->getOverlappingPairCache()->getNumOverlappingPairs());
+      profiler->setCount(StepProfiler::MANIFOLDS, dispatcher->getNumManifolds());
+      profiler->setCount(StepProfiler::CONTACTS, contacts);
+    }
+    profiler->endStep();
+}
+
+void Environment::saveState(EnvironmentState &state) const {
+    btSoftRigidDynamicsWorld *world = bullet->dynamicsWorld;
+
+    const btCollisionObjectArray &objs = world->getCollisionObjectArray();
+    state.bodies.resize(objs.size());
+    for (int i = 0; i < objs.size(); ++i) {
+        const btCollisionObject *obj = objs[i];
+        EnvironmentState::BodyState &s = state.bodies[i];
+        s.obj = obj;
+        s.worldTransform = obj->getWorldTransform();
+        s.interpolationWorldTransform = obj->getInterpolationWorldTransform();
+        s.interpolationLinearVelocity = obj->getInterpolationLinearVelocity();
+        s.interpolationAngularVelocity = obj->getInterpolationAngularVelocity();
+        s.deactivationTime = obj->getDeactivationTime();
+        s.hitFraction = obj->getHitFraction();
+        s.activationState = obj->getActivationState();
+
+        const btRigidBody *rb = btRigidBody::upcast(obj);
+        s.isRigidBody = rb != NULL;
+        s.hasMotionState = false;
+        if (rb) {
+            s.linearVelocity = rb->getLinearVelocity();
+            s.angularVelocity = rb->getAngularVelocity();
+            s.totalForce = rb->getTotalForce();
+            s.totalTorque = rb->getTotalTorque();
+            // kinematic objects get their pose from the motion state on every step
+            const btDefaultMotionState *ms = dynamic_cast<const btDefaultMotionState *>(rb->getMotionState());
+            if (ms) {
+                s.hasMotionState = true;
+                s.motionStateTransform = ms->m_graphicsWorldTrans;
+            }
+        }
+    }
+
+    state.constraints.resize(world->getNumConstraints());
+    for (int i = 0; i < world->getNumConstraints(); ++i) {
+        btTypedConstraint *cnt = world->getConstraint(i);
+        EnvironmentState::ConstraintState &s = state.constraints[i];
+        s.cnt = cnt;
+        s.appliedImpulse = cnt->internalGetAppliedImpulse();
+        s.enabled = cnt->isEnabled();
+    }
+
+    // the contact points hold the warm-starting impulses for the solver
+    btCollisionDispatcher *dispatcher = bullet->dispatcher;
+    state.manifolds.resize(dispatcher->getNumManifolds());
+    for (int i = 0; i < dispatcher->getNumManifolds(); ++i) {
+        const btPersistentManifold *manifold = dispatcher->getManifoldByIndexInternal(i);
+        EnvironmentState::ManifoldState &s = state.manifolds[i];
+        s.manifold = manifold;
+        s.body0 = manifold->getBody0();
+        s.body1 = manifold->getBody1();
+        s.numContacts = manifold->getNumContacts();
+        for (int j = 0; j < s.numContacts; ++j) {
+            s.points[j] = manifold->getContactPoint(j);
+            s.points[j].m_userPersistentData = 0;
+        }
     }
+
+    state.solverSeed = bullet->solver->getRandSeed();
+    state.localTime = static_cast<ProfiledDynamicsWorld *>(world)->getLocalTime();
+}
+
+EnvironmentState::Ptr Environment::saveState() const {
+    EnvironmentState::Ptr state(new EnvironmentState);
+    saveState(*state);
+    return state;
+}
+
+static void restoreManifold(btPersistentManifold *manifold, const EnvironmentState::ManifoldState &s) {
+    manifold->clearManifold();
+    for (int j = 0; j < s.numContacts; ++j)
+        manifold->addManifoldPoint(s.points[j]);
+}
+
+void Environment::restoreState(const EnvironmentState &state) {
+    btSoftRigidDynamicsWorld *world = bullet->dynamicsWorld;
+
+    btCollisionObjectArray &objs = world->getCollisionObjectArray();
+    if (objs.size() != state.bodies.size())
+        throw std::runtime_error("restoreState: collision objects were added or removed since the state was saved");
+    for (int i = 0; i < objs.size(); ++i)
+        if (objs[i] != state.bodies[i].obj)
+            throw std::runtime_error("restoreState: collision objects were added or removed since the state was saved");
+    if (world->getNumConstraints() != state.constraints.size())
+        throw std::runtime_error("restoreState: constraints were added or removed since the state was saved");
+    for (int i = 0; i < world->getNumConstraints(); ++i)
+        if (world->getConstraint(i) != state.constraints[i].cnt)
+            throw std::runtime_error("restoreState: constraints were added or removed since the state was saved");
+
+    for (int i = 0; i < objs.size(); ++i) {
+        btCollisionObject *obj = objs[i];
+        const EnvironmentState::BodyState &s = state.bodies[i];
+        obj->setWorldTransform(s.worldTransform);
+        obj->setInterpolationWorldTransform(s.interpolationWorldTransform);
+        obj->setInterpolationLinearVelocity(s.interpolationLinearVelocity);
+        obj->setInterpolationAngularVelocity(s.interpolationAngularVelocity);
+        obj->setHitFraction(s.hitFraction);
+        obj->forceActivationState(s.activationState);
+        obj->setDeactivationTime(s.deactivationTime);
+
+        btRigidBody *rb = btRigidBody::upcast(obj);
+        if (rb && s.isRigidBody) {
+            // the world inverse inertia follows the orientation
+            rb->updateInertiaTensor();
+            rb->setLinearVelocity(s.linearVelocity);
+            rb->setAngularVelocity(s.angularVelocity);
+            rb->clearForces();
+            rb->applyCentralForce(s.totalForce);
+            rb->applyTorque(s.totalTorque);
+            btDefaultMotionState *ms = dynamic_cast<btDefaultMotionState *>(rb->getMotionState());
+            if (ms && s.hasMotionState)
+                ms->m_graphicsWorldTrans = s.motionStateTransform;
+        }
+    }
+
+    for (int i = 0; i < world->getNumConstraints(); ++i) {
+        btTypedConstraint *cnt = world->getConstraint(i);
+        const EnvironmentState::ConstraintState &s = state.constraints[i];
+        cnt->internalSetAppliedImpulse(s.appliedImpulse);
+        cnt->setEnabled(s.enabled);
+    }
+
+    // the dispatcher may have created, destroyed or reordered manifolds since the save.
+    // match them up by address and bodies; usually nothing changed and the order is the same
+    btCollisionDispatcher *dispatcher = bullet->dispatcher;
+    std::map<const btPersistentManifold *, int> savedIndex;
+    for (int i = 0; i < dispatcher->getNumManifolds(); ++i) {
+        btPersistentManifold *manifold = dispatcher->getManifoldByIndexInternal(i);
+        int j = -1;
+        if (i < state.manifolds.size() && state.manifolds[i].manifold == manifold) {
+            j = i;
+        } else {
+            if (savedIndex.empty())
+                for (int k = 0; k < state.manifolds.size(); ++k)
+                    savedIndex[state.manifolds[k].manifold] = k;
+            std::map<const btPersistentManifold *, int>::const_iterator it = savedIndex.find(manifold);
+            if (it != savedIndex.end()) j = it->second;
+        }
+        if (j >= 0 && state.manifolds[j].body0 == manifold->getBody0() && state.manifolds[j].body1 == manifold->getBody1())
+            restoreManifold(manifold, state.manifolds[j]);
+        else
+            manifold->clearManifold();
+    }
+
+    bullet->solver->setRandSeed(state.solverSeed);
+    static_cast<ProfiledDynamicsWorld *>(world)->setLocalTime(state.localTime);
+    world->updateAabbs();
 }
 
 Fork::Fork(const Environment *parentEnv_, BulletInstance::Ptr bullet) :
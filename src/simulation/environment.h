@@ -8,11 +8,83 @@
 #include <set>
 #include <map>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
 #include <iostream>
 #include <stdexcept>
+#include "profiler.h"
 
 using namespace std;
 
+class btThreadSupportInterface;
+
+// closest points between a part of objA and a part of objB, in world coordinates
+struct DistanceResult {
+    const btCollisionObject *objA, *objB;
+    btVector3 ptA, ptB;
+    btVector3 normalB2A;
+    btScalar distance; // negative when they penetrate
+};
+
+// A set of collision objects stored as a bitmask over their broadphase proxy ids, so that
+// membership tests in collision queries don't need a lookup. Objects are kept by pointer,
+// and update() rebuilds the mask when one of them got a new proxy (e.g. because it was
+// added to a world after being inserted); until then it's stale.
+class CollisionObjectMask {
+public:
+    CollisionObjectMask() : stale(false) { }
+
+    void insert(const btCollisionObject *obj);
+    const std::vector<const btCollisionObject *> &getObjects() const { return objects; }
+
+    void update();
+    bool contains(const btBroadphaseProxy *proxy) const {
+        return proxy->m_uniqueId < (int) bits.size() && bits[proxy->m_uniqueId];
+    }
+
+private:
+    std::vector<const btCollisionObject *> objects;
+    std::vector<int> ids; // proxy id of each object when the mask was built, -1 if none
+    std::vector<bool> bits;
+    bool stale;
+};
+
+// Pairs of collision objects that must never collide: links joined by a joint, bodies
+// linked by a constraint, link pairs that can't touch. Stored as a bitmatrix over a
+// compact index per object, and installed as the overlap filter of a world's pair cache,
+// so those pairs never get a broadphase pair, let alone an algorithm or a manifold.
+// Otherwise it filters like the default pair cache (collision groups and masks).
+// Use BulletInstance::disableCollision, which also takes care of pairs that already exist.
+class CollisionPairFilter : public btOverlapFilterCallback {
+public:
+    CollisionPairFilter() : m_size(0) { }
+
+    // reference counted: a pair disabled twice (e.g. by two constraints) needs two enables.
+    // enable returns true if the pair can collide again. Objects only hold an index while
+    // they're in some disabled pair, so the matrix is bounded by the live ones
+    void disable(const btCollisionObject *a, const btCollisionObject *b);
+    bool enable(const btCollisionObject *a, const btCollisionObject *b);
+    bool isDisabled(const btCollisionObject *a, const btCollisionObject *b) const;
+    void clear();
+
+    bool needBroadphaseCollision(btBroadphaseProxy *proxy0, btBroadphaseProxy *proxy1) const;
+
+private:
+    int indexOf(const btCollisionObject *obj) const;
+    int addIndex(const btCollisionObject *obj);
+    void releaseIndex(int i);
+
+    boost::unordered_map<const btCollisionObject *, int> m_indices;
+    std::vector<const btCollisionObject *> m_objects; // by index, NULL if free
+    std::vector<int> m_numPairs; // disabled pairs each index is in
+    std::vector<int> m_free;
+    std::map<std::pair<int, int>, int> m_counts; // by (smaller, larger) index
+    std::vector<bool> m_bits; // m_size x m_size, symmetric
+    int m_size;
+};
+
 struct BulletInstance {
     typedef boost::shared_ptr<BulletInstance> Ptr;
 
@@ -23,17 +95,116 @@ struct BulletInstance {
     btSoftRigidDynamicsWorld *dynamicsWorld;
     btSoftBodyWorldInfo *softBodyWorldInfo;
 
+    // timings of Environment::step; dynamicsWorld is a ProfiledDynamicsWorld reporting to it
+    StepProfiler::Ptr profiler;
+
+    // the overlap filter of the world's pair cache. Cleared by reset()
+    CollisionPairFilter pairFilter;
+
+    enum SolverType {
+        SEQUENTIAL_IMPULSE = 0, // btSequentialImpulseConstraintSolver
+        PARALLEL = 1            // btParallelConstraintSolver, on max(numThreads, 1) pthreads
+    };
+
+    // worker threads for the narrowphase and the solver, NULL if they run on the calling thread
+    btThreadSupportInterface *collisionThreads;
+    btThreadSupportInterface *solverThreads;
+    int numThreads;
+    SolverType solverType;
+
+    // uses BulletConfig::numThreads and BulletConfig::solverType
     BulletInstance();
+    // numThreads > 1 runs the narrowphase on that many pthreads
+    // (SpuGatheringCollisionDispatcher); otherwise everything runs on the calling thread
+    explicit BulletInstance(int numThreads, SolverType solverType=SEQUENTIAL_IMPULSE);
     ~BulletInstance();
 
     void setGravity(const btVector3 &gravity);
     void setDefaultGravity();
 
+    // Removes everything left in the world and puts it back the way init() left it
+    // (gravity, solver, sub-step remainder, dispatcher flags, solver/dispatch/soft body settings),
+    // so a recycled instance steps like a new one, but keeps the broadphase, pair cache,
+    // collision pools and sparse SDF table allocated.
+    void reset();
+
+    // Stops (or lets again) a and b from colliding through pairFilter. Their existing
+    // broadphase pair, if any, is removed with its manifold; enabling adds it back
+    // right away if their AABBs overlap.
+    void disableCollision(btCollisionObject *a, btCollisionObject *b);
+    void enableCollision(btCollisionObject *a, btCollisionObject *b);
+
+    // The distance beyond which Bullet drops contact points between a and b from their
+    // manifold (see btCollisionDispatcher::getNewManifold). btCollisionWorld::contactTest
+    // reports such points anyway; the contact queries here filter them out.
+    btScalar contactBreakingThreshold(const btCollisionObject *a, const btCollisionObject *b) const;
     // Populates out with all objects colliding with obj, possibly ignoring some objects
     // dynamicsWorld->updateAabbs() must be called before contactTest
     // see http://bulletphysics.org/Bullet/phpBB3/viewtopic.php?t=4850
     typedef std::set<const btCollisionObject *> CollisionObjectSet;
     void contactTest(btCollisionObject *obj, CollisionObjectSet &out, const CollisionObjectSet *ignore=NULL);
+    // Returns true if obj touches any object that isn't in ignore (which must be up to date)
+    // or disabled in pairFilter. Stops doing narrowphase work at the first contact. Only the broadphase AABBs of the
+    // other objects have to be current; obj's is computed from its transform. Soft bodies are
+    // tested node by node, each node a sphere of the soft body's margin.
+    // Collision algorithms come from dispatcher (NULL: the world's), see ParallelContactTester.
+    bool contactTestAny(btCollisionObject *obj, const CollisionObjectMask &ignore, btDispatcher *dispatcher=NULL);
+    // Returns true if shape, moved from one transform to the other, hits any object that isn't
+    // in ignore. The motion is linear in position and orientation, so it only approximates the
+    // path of a link between two robot configurations. Reads the world but doesn't change it,
+    // so it's safe to call from several threads.
+    bool convexSweepTestAny(const btConvexShape *shape, const btTransform &from, const btTransform &to,
+                            const CollisionObjectMask &ignore);
+    // true if a and b touch, whether or not they are in the world; ignores filters
+    bool contactPairTestAny(btCollisionObject *a, btCollisionObject *b);
+    // Appends the closest points between obj and every object within maxDist of it that isn't
+    // in ignore or disabled in pairFilter: one DistanceResult per pair of convex parts (compound children; for triangle
+    // meshes, the closest triangle) that are at most maxDist apart. Stateless, unlike contact
+    // manifolds: the broadphase is queried with obj's AABB grown by maxDist, and each pair of
+    // parts goes through GJK, and EPA when they overlap. Reads the world but doesn't change it.
+    void distanceTest(btCollisionObject *obj, btScalar maxDist, const CollisionObjectMask &ignore,
+                      std::vector<DistanceResult> &out);
+
+private:
+    void init();
+
+    // settings as init() made them, for reset()
+    int m_initDispatcherFlags;
+    btContactSolverInfo m_initSolverInfo;
+    btDispatcherInfo m_initDispatchInfo;
+    btSoftBodyWorldInfo m_initSoftBodyWorldInfo; // only the medium fields are used
+};
+
+// Keeps cleared BulletInstances around for reuse, so that code that creates
+// and throws away many environments (e.g. forks in a tree search)
+// doesn't pay for allocating and freeing a whole Bullet world every time.
+// Instances handed out by acquire() go back to the pool (after BulletInstance::reset)
+// when their last reference is released, or are deleted if the pool is gone or full.
+// Must be owned by a shared_ptr. acquire() may be called from multiple threads.
+class BulletInstancePool : public boost::enable_shared_from_this<BulletInstancePool> {
+public:
+    typedef boost::shared_ptr<BulletInstancePool> Ptr;
+
+    // maxFree <= 0 means the number of idle instances kept is unbounded
+    explicit BulletInstancePool(int maxFree=0) : m_maxFree(maxFree) { }
+    ~BulletInstancePool();
+
+    BulletInstance::Ptr acquire();
+    int numFree();
+    // deletes all idle instances
+    void clear();
+
+private:
+    boost::mutex m_mutex;
+    std::vector<BulletInstance *> m_free;
+    int m_maxFree;
+
+    struct Recycler {
+        boost::weak_ptr<BulletInstancePool> pool;
+        Recycler(boost::weak_ptr<BulletInstancePool> pool_) : pool(pool_) { }
+        void operator()(BulletInstance *bullet);
+    };
+    void release(BulletInstance *bullet);
 };
 
 struct Environment;
@@ -51,6 +222,11 @@ public:
 
     Environment *getEnvironment() { return env; }
 
+    // keys for the Environment's object index, read when the object is added.
+    // objects with an empty name or an id <= 0 aren't indexed by it
+    virtual std::string getName() const { return std::string(); }
+    virtual int getId() const { return 0; }
+
     // These are for environment forking.
     // copy() should return a copy of the object suitable for addition
     // into the environment contained by f. This should NOT add objects to f.env;
@@ -77,6 +253,42 @@ public:
 		virtual btTransform getIndexTransform(int index) { std::runtime_error("getIndexTransform() hasn't been defined yet"); return btTransform();}
 };
 
+// A snapshot of the dynamic state of the rigid bodies, constraints and contact manifolds
+// in an Environment's Bullet world, taken by Environment::saveState.
+// The arrays keep their capacity, so saving into the same state object
+// again doesn't allocate. (Soft bodies are not captured.)
+struct EnvironmentState {
+    typedef boost::shared_ptr<EnvironmentState> Ptr;
+
+    struct BodyState {
+        const btCollisionObject *obj;
+        btTransform worldTransform, interpolationWorldTransform, motionStateTransform;
+        btVector3 linearVelocity, angularVelocity;
+        btVector3 interpolationLinearVelocity, interpolationAngularVelocity;
+        btVector3 totalForce, totalTorque;
+        btScalar deactivationTime, hitFraction;
+        int activationState;
+        bool isRigidBody, hasMotionState;
+    };
+    struct ConstraintState {
+        const btTypedConstraint *cnt;
+        btScalar appliedImpulse;
+        bool enabled;
+    };
+    struct ManifoldState {
+        const btPersistentManifold *manifold;
+        const void *body0, *body1;
+        int numContacts;
+        btManifoldPoint points[MANIFOLD_CACHE_SIZE];
+    };
+
+    btAlignedObjectArray<BodyState> bodies;
+    btAlignedObjectArray<ConstraintState> constraints;
+    btAlignedObjectArray<ManifoldState> manifolds;
+    unsigned long solverSeed;
+    btScalar localTime; // see ProfiledDynamicsWorld::getLocalTime
+};
+
 class RaveInstance;
 typedef boost::shared_ptr<RaveInstance> RaveInstancePtr;
 struct Environment {
@@ -96,10 +308,30 @@ struct Environment {
     void add(EnvironmentObject::Ptr obj);
     void remove(EnvironmentObject::Ptr obj);
 
+    // O(1) lookup by EnvironmentObject::getName() and getId(). Returns NULL if there's no such object
+    EnvironmentObject::Ptr getObjectByName(const std::string &name) const;
+    EnvironmentObject::Ptr getObjectById(int id) const;
+
     void addConstraint(EnvironmentObject::Ptr cnt);
     void removeConstraint(EnvironmentObject::Ptr cnt);
 
     void step(btScalar dt, int maxSubSteps, btScalar fixedTimeStep);
+
+    // Cheap alternative to forking for try-and-roll-back: saveState copies
+    // the dynamic state of the Bullet world into state, and restoreState writes it back in place.
+    // restoreState throws if bodies or constraints were added or removed since the save.
+    // Contact points are restored for manifolds that still exist; manifolds created
+    // after the save are cleared.
+    void saveState(EnvironmentState &state) const;
+    EnvironmentState::Ptr saveState() const;
+    void restoreState(const EnvironmentState &state);
+
+private:
+    // maintained by add and remove
+    typedef boost::unordered_map<std::string, EnvironmentObject::Ptr> NameIndex;
+    typedef boost::unordered_map<int, EnvironmentObject::Ptr> IdIndex;
+    NameIndex objectsByName;
+    IdIndex objectsById;
 };
 
 // An Environment Fork is a wrapper around an Environment with an operator
@@ -114,6 +346,11 @@ public:
     Environment::Ptr env;
     RaveInstancePtr rave;
 
+    // if rave isn't given, each RaveInstance in parentEnv is cloned at most once
+    // per fork and the clone is shared by all copied objects (see RaveObject::internalCopy)
+    typedef std::map<const RaveInstance *, RaveInstancePtr> RaveInstanceMap;
+    RaveInstanceMap raveCopies;
+
     typedef std::map<EnvironmentObject *, EnvironmentObject::Ptr> ObjectMap;
     ObjectMap objMap; // maps object in parentEnv to object in env
 
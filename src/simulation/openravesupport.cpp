@@ -1,12 +1,18 @@
 #include <openrave-core.h>
 #include "openravesupport.h"
-#include <BulletCollision/CollisionShapes/btShapeHull.h>
 #include "config.h"
 #include "bullet_io.h"
 #include "logging.h"
 #include "config_bullet.h"
+#include "shape_cache.h"
+#include "collision_checking.h"
+#include "thread_pool.h"
 
 #include <set>
+#include <boost/scoped_ptr.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
 
 using namespace OpenRAVE;
 using namespace std;
@@ -67,6 +73,62 @@ void RaveLinkObject::destroy() {
   rave->bulletsim2rave_links.erase(rigidBody.get());
 }
 
+static boost::shared_ptr<LinkGeometry> createLinkGeometry(KinBody::LinkPtr link, TrimeshMode trimeshMode);
+
+KinBodyGeometry::KinBodyGeometry(KinBodyPtr body_, TrimeshMode trimeshMode_) :
+  body(body_), trimeshMode(trimeshMode_), links(body_->GetLinks().size()) { }
+
+void KinBodyGeometry::buildLink(int i) {
+  links[i] = createLinkGeometry(body->GetLinks()[i], trimeshMode);
+}
+
+void KinBodyGeometry::build() {
+  for (int i = 0; i < links.size(); ++i) buildLink(i);
+}
+
+namespace {
+struct LinkGeometryTask {
+  std::vector<std::pair<KinBodyGeometry*, int> > &tasks;
+  LinkGeometryTask(std::vector<std::pair<KinBodyGeometry*, int> > &tasks_) : tasks(tasks_) { }
+  void operator()(int i) const { tasks[i].first->buildLink(tasks[i].second); }
+};
+}
+
+// Loads bodies in two phases. Collision shapes only read OpenRAVE and the ShapeCache,
+// so all links of all bodies are built on BulletConfig::loadThreads threads. Rigid
+// bodies, constraints and world insertion touch Bullet's global state (btRigidBody
+// numbers itself from a static counter), so that part stays on the calling thread.
+static void LoadBodies(Environment::Ptr env, RaveInstance::Ptr rave,
+    const std::vector<KinBodyPtr> &bodies, const std::vector<char> &kinematic) {
+  TrimeshMode trimeshMode = (TrimeshMode) BulletConfig::trimeshMode;
+  std::vector<KinBodyGeometry::Ptr> geometries;
+  std::vector<std::pair<KinBodyGeometry*, int> > tasks;
+  BOOST_FOREACH(const KinBodyPtr &body, bodies) {
+    geometries.push_back(KinBodyGeometry::Ptr(new KinBodyGeometry(body, trimeshMode)));
+    for (int i = 0; i < geometries.back()->links.size(); ++i)
+      tasks.push_back(std::make_pair(geometries.back().get(), i));
+  }
+
+  if (BulletConfig::loadThreads == 1 || tasks.size() < 2) {
+    for (int i = 0; i < tasks.size(); ++i) tasks[i].first->buildLink(tasks[i].second);
+  } else {
+    ThreadPool threads(BulletConfig::loadThreads);
+    threads.parallelFor(tasks.size(), LinkGeometryTask(tasks));
+  }
+
+  for (int i = 0; i < bodies.size(); ++i) {
+    const KinBodyPtr &body = bodies[i];
+    if (body->IsRobot()) {
+      LOG_INFO("loading robot " << body->GetName());
+      env->add(RaveRobotObject::Ptr(new RaveRobotObject(
+        rave, boost::dynamic_pointer_cast<RobotBase>(body), *geometries[i], kinematic[i])));
+    } else {
+      LOG_INFO("loading " << body->GetName());
+      env->add(RaveObject::Ptr(new RaveObject(rave, *geometries[i], kinematic[i])));
+    }
+  }
+}
+
 void LoadFromRave(Environment::Ptr env, RaveInstance::Ptr rave) {
 
   std::set<string> bodiesAlreadyLoaded;
@@ -75,18 +137,16 @@ void LoadFromRave(Environment::Ptr env, RaveInstance::Ptr rave) {
     if (robj) bodiesAlreadyLoaded.insert(robj->body->GetName());
   }
 
-  std::vector<boost::shared_ptr<OpenRAVE::KinBody> > bodies;
+  std::vector<boost::shared_ptr<OpenRAVE::KinBody> > bodies, toLoad;
+  std::vector<char> kinematic;
   rave->env->GetBodies(bodies);
   BOOST_FOREACH(OpenRAVE::KinBodyPtr body, bodies) {
     if (bodiesAlreadyLoaded.find(body->GetName()) == bodiesAlreadyLoaded.end()) {
-      if (body->IsRobot()) env->add(RaveRobotObject::Ptr(new RaveRobotObject(
-				rave, boost::dynamic_pointer_cast<RobotBase>(body), CONVEX_HULL, BulletConfig::kinematicPolicy <= 1)));
-      else {
-        LOG_INFO("loading " << body->GetName());
-        env->add(RaveObject::Ptr(new RaveObject(rave, body, CONVEX_HULL, BulletConfig::kinematicPolicy == 0)));
-      }
+      toLoad.push_back(body);
+      kinematic.push_back(body->IsRobot() ? BulletConfig::kinematicPolicy <= 1 : BulletConfig::kinematicPolicy == 0);
     }
   }
+  LoadBodies(env, rave, toLoad, kinematic);
 
 }
 
@@ -101,37 +161,36 @@ void GetLoadedBodies(Environment::Ptr env, std::set<string> &bodiesAlreadyLoaded
 }
 
 void LoadFromRaveSingle(Environment::Ptr env, RaveInstance::Ptr rave, OpenRAVE::KinBodyPtr body, bool isKinematic, bool checkLoaded) {
-  std::set<string> bodiesAlreadyLoaded;
-  if (checkLoaded) {
-    GetLoadedBodies(env, bodiesAlreadyLoaded);
-    if (bodiesAlreadyLoaded.find(body->GetName()) != bodiesAlreadyLoaded.end()) {
-      LOG_WARN("body " << body->GetName() << " already loaded; not loading");
-      return;
-    }
+  if (checkLoaded && boost::dynamic_pointer_cast<RaveObject>(env->getObjectByName(body->GetName()))) {
+    LOG_WARN("body " << body->GetName() << " already loaded; not loading");
+    return;
   }
 
   if (body->IsRobot()) {
     LOG_INFO("loading robot " << body->GetName());
     env->add(RaveRobotObject::Ptr(new RaveRobotObject(
-      rave, boost::dynamic_pointer_cast<RobotBase>(body), CONVEX_HULL, isKinematic)));
+      rave, boost::dynamic_pointer_cast<RobotBase>(body), (TrimeshMode) BulletConfig::trimeshMode, isKinematic)));
   } else {
     LOG_INFO("loading " << body->GetName());
-    env->add(RaveObject::Ptr(new RaveObject(rave, body, CONVEX_HULL, isKinematic)));
+    env->add(RaveObject::Ptr(new RaveObject(rave, body, (TrimeshMode) BulletConfig::trimeshMode, isKinematic)));
   }
 }
 
 // explicit kinematic policy
 void LoadFromRaveExplicit(Environment::Ptr env, RaveInstance::Ptr rave, const vector<string> &dynamicNames) {
   std::set<string> bodiesAlreadyLoaded;
-  BOOST_FOREACH(EnvironmentObject::Ptr obj, env->objects) {
-    GetLoadedBodies(env, bodiesAlreadyLoaded);
-  }
-  std::vector<boost::shared_ptr<OpenRAVE::KinBody> > bodies;
+  GetLoadedBodies(env, bodiesAlreadyLoaded);
+  std::set<string> dynamic(dynamicNames.begin(), dynamicNames.end());
+
+  std::vector<boost::shared_ptr<OpenRAVE::KinBody> > bodies, toLoad;
+  std::vector<char> kinematic;
   rave->env->GetBodies(bodies);
   BOOST_FOREACH(OpenRAVE::KinBodyPtr body, bodies) {
-    bool isKinematic = std::find(dynamicNames.begin(), dynamicNames.end(), body->GetName()) == dynamicNames.end();
-    LoadFromRaveSingle(env, rave, body, isKinematic, false);
+    if (bodiesAlreadyLoaded.count(body->GetName())) continue;
+    toLoad.push_back(body);
+    kinematic.push_back(!dynamic.count(body->GetName()));
   }
+  LoadBodies(env, rave, toLoad, kinematic);
 }
 
 void Load(Environment::Ptr env, RaveInstance::Ptr rave, const string& filename) {
@@ -146,13 +205,16 @@ void Load(Environment::Ptr env, RaveInstance::Ptr rave, const string& filename)
 
 
 RaveObject::Ptr getObjectByName(Environment::Ptr env, RaveInstance::Ptr rave, const string& name) {
-  BOOST_FOREACH(EnvironmentObject::Ptr obj, env->objects) {
-    RaveObject::Ptr maybeRO = boost::dynamic_pointer_cast<RaveObject>(obj);
-    if (maybeRO && maybeRO->body->GetName() == name) {
-      return maybeRO;
-    }
+  return boost::dynamic_pointer_cast<RaveObject>(env->getObjectByName(name));
+}
+
+RaveObject::Ptr getObjectByKinBody(Environment::Ptr env, RaveInstance::Ptr rave, KinBodyPtr body) {
+  RaveObject::Ptr obj = boost::dynamic_pointer_cast<RaveObject>(env->getObjectById(body->GetEnvironmentId()));
+  // the id can be stale if the body was re-added to the OpenRAVE environment after loading
+  if (!obj || obj->body != body) {
+    obj = getObjectByName(env, rave, body->GetName());
   }
-  return RaveObject::Ptr();
+  return obj && obj->body == body ? obj : RaveObject::Ptr();
 }
 
 std::vector<RaveRobotObject::Ptr> getRobots(Environment::Ptr env, RaveInstance::Ptr rave) {
@@ -173,6 +235,10 @@ RaveObject::RaveObject(RaveInstance::Ptr rave_, KinBodyPtr body_, TrimeshMode tr
 }
 
 
+RaveObject::RaveObject(RaveInstance::Ptr rave_, const KinBodyGeometry &geometry, bool isKinematic_) {
+	initRaveObject(rave_, geometry, isKinematic_);
+}
+
 RaveObject::RaveObject(RaveInstance::Ptr rave_, KinBodyPtr body_,
     const vector<RaveLinkObject::Ptr> &bulletLinks, const vector<BulletConstraint::Ptr> &constraints_,
     bool isKinematic_) {
@@ -185,9 +251,17 @@ void RaveObject::init() {
   BOOST_FOREACH(BulletConstraint::Ptr &cnt, constraints) {
     getEnvironment()->addConstraint(cnt);
   }
+  for (int k = 0; k < disabledLinkPairs.size(); ++k) {
+    getEnvironment()->bullet->disableCollision(children[disabledLinkPairs[k].first]->rigidBody.get(),
+                                               children[disabledLinkPairs[k].second]->rigidBody.get());
+  }
 }
 
 void RaveObject::destroy() {
+  for (int k = 0; k < disabledLinkPairs.size(); ++k) {
+    getEnvironment()->bullet->enableCollision(children[disabledLinkPairs[k].first]->rigidBody.get(),
+                                              children[disabledLinkPairs[k].second]->rigidBody.get());
+  }
   CompoundRaveLinkObject::destroy();
 
   rave->rave2bulletsim.erase(body);
@@ -199,13 +273,21 @@ void RaveObject::destroy() {
 }
 
 
-static RaveLinkObject::Ptr createFromLink(RaveInstance::Ptr rave, KinBody::LinkPtr link,
-        std::vector<boost::shared_ptr<btCollisionShape> >& subshapes,
-        std::vector<boost::shared_ptr<btStridingMeshInterface> >& meshes,
-         TrimeshMode trimeshMode,
-        bool isKinematic) {
+// Everything a link's collision shape refers to. Shapes are never modified once built,
+// so the link's rigid body and all its copies in forks share one LinkGeometry: the
+// shape pointers they hold alias it and keep it alive.
+struct LinkGeometry {
+  std::vector<boost::shared_ptr<btStridingMeshInterface> > meshes;
+  std::vector<boost::shared_ptr<btCollisionShape> > subshapes;
+  boost::scoped_ptr<btCompoundShape> compound;
+  bool useGraphicsMesh;
+  LinkGeometry() : useGraphicsMesh(false) { }
+};
 
-  LOG_DEBUG("creating link from " << link->GetName());
+// may run on any thread: only reads the link and the ShapeCache
+static boost::shared_ptr<LinkGeometry> createLinkGeometry(KinBody::LinkPtr link, TrimeshMode trimeshMode) {
+
+  LOG_DEBUG("creating link geometry from " << link->GetName());
 
 #if OPENRAVE_VERSION_MINOR>6
   const std::vector<boost::shared_ptr<OpenRAVE::KinBody::Link::GEOMPROPERTIES> > & geometries=link->GetGeometries();
@@ -216,16 +298,20 @@ static RaveLinkObject::Ptr createFromLink(RaveInstance::Ptr rave, KinBody::LinkP
   // (this is the case with the PR2 model). therefore just add an empty BulletObject
   // pointer so we know to skip it in the future
   if (geometries.empty()) {
-  	return RaveLinkObject::Ptr();
+  	return boost::shared_ptr<LinkGeometry>();
   }
 
 //	bool useCompound = geometries.size() > 1;
 	bool useCompound = true;
-  bool useGraphicsMesh = false;
+
+  boost::shared_ptr<LinkGeometry> geometry(new LinkGeometry);
+  bool &useGraphicsMesh = geometry->useGraphicsMesh;
+  std::vector<boost::shared_ptr<btCollisionShape> > &subshapes = geometry->subshapes;
+  std::vector<boost::shared_ptr<btStridingMeshInterface> > &meshes = geometry->meshes;
 
 	btCompoundShape* compound;
 	if (useCompound) {
-    compound = new btCompoundShape();
+    geometry->compound.reset(compound = new btCompoundShape());
     compound->setMargin(1e-5*METERS); //margin: compound. seems to have no effect when positive but has an effect when negative
 	}
 
@@ -262,40 +348,58 @@ static RaveLinkObject::Ptr createFromLink(RaveInstance::Ptr rave, KinBody::LinkP
 			if (mesh.indices.size() < 3)
 				break;
       else {
-        btTriangleMesh* ptrimesh = new btTriangleMesh();
-        // for some reason adding indices makes everything crash
-        /*
-         printf("-----------\n");
-         for (int z = 0; z < mesh.indices.size(); ++z)
-         printf("%d\n", mesh.indices[z]);
-         printf("-----------\n");*/
-
-
-        for (size_t i = 0; i < mesh.indices.size(); i += 3)
-          ptrimesh->addTriangle(util::toBtVector(mesh.vertices[i])*METERS,
-                      util::toBtVector(mesh.vertices[i+1])*METERS,
-                      util::toBtVector(mesh.vertices[i+2])*METERS);
-        // store the trimesh somewhere so it doesn't get deallocated by the smart pointer
-        meshes.push_back(boost::shared_ptr<btStridingMeshInterface>(ptrimesh));
-
         if (BulletConfig::graphicsMesh) useGraphicsMesh = true;
 
+        // the mesh data (indexed, with duplicate vertices merged) is shared by all the
+        // environments that load this geometry, and the hull only depends on the mesh and
+        // the padding, so both come from the cache. The mesh is only built if it's needed
+        ShapeCache &cache = ShapeCache::instance();
+        ShapeCache::IndexedMeshPtr indexed;
         if (trimeshMode == CONVEX_HULL) {
-          boost::shared_ptr<btConvexShape> pconvexbuilder(new btConvexTriangleMeshShape(ptrimesh));
-          pconvexbuilder->setMargin(BulletConfig::linkPadding*METERS); // margin: hull padding
-
-          //Create a hull shape to approximate Trimesh
-          boost::shared_ptr<btShapeHull> hull(new btShapeHull(pconvexbuilder.get()));
-          hull->buildHull(-666); // note: margin argument not used
-
-          btConvexHullShape *convexShape = new btConvexHullShape();
-          for (int i = 0; i < hull->numVertices(); ++i)
-            convexShape->addPoint(hull->getVertexPointer()[i]);
-
-          subshape.reset(convexShape);
+          btScalar hullMargin = BulletConfig::linkPadding*METERS; // margin: hull padding
+          ShapeCache::PointsPtr hull = cache.findConvexHull(ShapeCache::meshKey(mesh.vertices, mesh.indices, METERS), hullMargin);
+          if (!hull && (indexed = cache.indexedMesh(mesh.vertices, mesh.indices, METERS)))
+            hull = cache.convexHull(indexed, hullMargin);
+          if (hull) {
+            subshape.reset(hull->empty() ? new btConvexHullShape() :
+                new btConvexHullShape(hull->front().m_floats, hull->size(), sizeof(btVector3)));
+          }
+        }
+        else if (trimeshMode == CONVEX_DECOMPOSITION) {
+          btScalar hullMargin = BulletConfig::linkPadding*METERS; // margin: hull padding
+          ShapeCache::DecompositionParams params;
+          params.minClusters = BulletConfig::hacdMinClusters;
+          params.maxVerticesPerHull = BulletConfig::hacdMaxVerticesPerHull;
+          params.concavity = BulletConfig::hacdConcavity;
+          ShapeCache::PiecesPtr pieces = cache.findConvexDecomposition(ShapeCache::meshKey(mesh.vertices, mesh.indices, METERS), hullMargin, params);
+          if (!pieces && (indexed = cache.indexedMesh(mesh.vertices, mesh.indices, METERS)))
+            pieces = cache.convexDecomposition(indexed, hullMargin, params);
+          if (pieces) {
+            // the pieces go in a compound of their own, which is added like any other subshape
+            btCompoundShape *decomposition = new btCompoundShape();
+            subshape.reset(decomposition);
+            BOOST_FOREACH(const ShapeCache::Points &points, *pieces) {
+              if (points.empty()) continue;
+              boost::shared_ptr<btCollisionShape> piece(new btConvexHullShape(points.front().m_floats, points.size(), sizeof(btVector3)));
+              piece->setMargin(BulletConfig::margin*METERS);
+              subshapes.push_back(piece);
+              decomposition->addChildShape(btTransform::getIdentity(), piece.get());
+            }
+          }
+        }
 
-        } else { // RAW
-          subshape.reset(new btBvhTriangleMeshShape(ptrimesh, true));
+        if (trimeshMode == RAW || useGraphicsMesh) {
+          if (!indexed) indexed = cache.indexedMesh(mesh.vertices, mesh.indices, METERS);
+          if (indexed) {
+            SharedTriangleMesh *ptrimesh = new SharedTriangleMesh(indexed);
+            // store the trimesh somewhere so it doesn't get deallocated by the smart pointer
+            meshes.push_back(boost::shared_ptr<btStridingMeshInterface>(ptrimesh));
+
+            if (trimeshMode == RAW) {
+              // the BVH is built once per mesh and shared by the shapes that use it
+              subshape.reset(new SharedBvhTriangleMeshShape(ptrimesh, cache.bvh(indexed)));
+            }
+          }
         }
       }
 			break;
@@ -317,18 +421,33 @@ static RaveLinkObject::Ptr createFromLink(RaveInstance::Ptr rave, KinBody::LinkP
 		if (useCompound) compound->addChildShape(geomTrans, subshape.get());
 	}
 
+  return geometry;
+}
+
+static RaveLinkObject::Ptr createFromLink(RaveInstance::Ptr rave, KinBody::LinkPtr link,
+        boost::shared_ptr<LinkGeometry> geometry, bool isKinematic) {
+
+  if (!geometry) return RaveLinkObject::Ptr();
+  LOG_DEBUG("creating link from " << link->GetName());
+  std::vector<boost::shared_ptr<btCollisionShape> > &subshapes = geometry->subshapes;
+  std::vector<boost::shared_ptr<btStridingMeshInterface> > &meshes = geometry->meshes;
+  btCompoundShape *compound = geometry->compound.get();
 
 	float mass = isKinematic ? 0 : link->GetMass();
 	if (mass==0 && !isKinematic) LOG_WARN_FMT("warning: link %s is non-kinematic but mass is zero", link->GetName().c_str());
 	RaveLinkObject::Ptr child;
-	if (useCompound) {
+	if (compound) {
     btTransform childTrans = util::toBtTransform(link->GetTransform(),GeneralConfig::scale);
-	  child.reset(new RaveLinkObject(rave, link, mass, compound, childTrans,isKinematic));
+	  child.reset(new RaveLinkObject(rave, link, mass, boost::shared_ptr<btCollisionShape>(geometry, compound), childTrans,isKinematic));
 	}
 	else {
 	  btTransform geomTrans = util::toBtTransform(link->GetTransform() * link->GetGeometry(0)->GetTransform(),METERS);
-    child.reset(new RaveLinkObject(rave, link, mass, subshapes.back(), geomTrans, isKinematic));
-    if (useGraphicsMesh) child->graphicsShape.reset(new btBvhTriangleMeshShape(meshes.back().get(), true));
+    child.reset(new RaveLinkObject(rave, link, mass, boost::shared_ptr<btCollisionShape>(geometry, subshapes.back().get()), geomTrans, isKinematic));
+    if (geometry->useGraphicsMesh) {
+      SharedTriangleMesh *graphicsMesh = static_cast<SharedTriangleMesh *>(meshes.back().get());
+      subshapes.push_back(boost::shared_ptr<btCollisionShape>(new SharedBvhTriangleMeshShape(graphicsMesh, ShapeCache::instance().bvh(graphicsMesh->getMesh()))));
+      child->graphicsShape = boost::shared_ptr<btCollisionShape>(geometry, subshapes.back().get());
+    }
 	}
 
 	return child;
@@ -403,6 +522,7 @@ void RaveObject::initRaveObject(RaveInstance::Ptr rave_, KinBodyPtr body_,
 
   rave = rave_;
   body = body_;
+  raveStamp = -1;
   rave->rave2bulletsim[body] = this;
   rave->bulletsim2rave[this] = body;
   isKinematic = isKinematic_;
@@ -426,13 +546,98 @@ void RaveObject::initRaveObject(RaveInstance::Ptr rave_, KinBodyPtr body_,
       ignoreCollisionWith(child->rigidBody.get());
     }
   }
+
+  // links joined by a joint touch all the time
+  BOOST_FOREACH(int pair, body->GetAdjacentLinks()) {
+    RaveLinkObject::Ptr a = bulletLinks[pair & 0xffff], b = bulletLinks[pair >> 16];
+    if (!a || !b) continue;
+    int i = childPosMap[a], j = childPosMap[b];
+    disabledLinkPairs.push_back(std::make_pair(std::min(i, j), std::max(i, j)));
+  }
+}
+
+void RaveObject::disableLinkPair(int i, int j) {
+  std::pair<int, int> pair(std::min(i, j), std::max(i, j));
+  if (std::find(disabledLinkPairs.begin(), disabledLinkPairs.end(), pair) != disabledLinkPairs.end()) return;
+  disabledLinkPairs.push_back(pair);
+  if (getEnvironment())
+    getEnvironment()->bullet->disableCollision(children[i]->rigidBody.get(), children[j]->rigidBody.get());
+}
+
+int RaveObject::disableNeverCollidingLinks(int samples) {
+  if (!getEnvironment()) throw std::runtime_error("disableNeverCollidingLinks: the object isn't in an environment");
+  // with no samples every pair would count as never touching
+  if (samples < 1) throw std::runtime_error((boost::format("disableNeverCollidingLinks: samples must be positive, got %d") % samples).str());
+  const int nc = children.size();
+  // stand-ins for the links, posed from the sampled link transforms
+  boost::scoped_array<btCollisionObject> links(new btCollisionObject[nc]);
+  for (int c = 0; c < nc; ++c) links[c].setCollisionShape(children[c]->rigidBody->getCollisionShape());
+  vector<char> candidate(nc*nc, 0);
+  for (int i = 0; i < nc; ++i)
+    for (int j = i + 1; j < nc; ++j) candidate[i*nc + j] = 1;
+  for (int k = 0; k < disabledLinkPairs.size(); ++k)
+    candidate[disabledLinkPairs[k].first*nc + disabledLinkPairs[k].second] = 0;
+  vector<int> touches(nc*nc, 0);
+
+  {
+    EnvironmentMutex::scoped_lock lock(rave->env->GetMutex());
+    KinBody::KinBodyStateSaver saver(body);
+    const vector<int> &linkInds = getLinkIndsWithGeometry();
+    vector<dReal> lower, upper, values(body->GetDOF());
+    body->GetDOFLimits(lower, upper);
+    // fixed seed, so the same robot always gets the same pairs
+    boost::mt19937 rng(0);
+    boost::random::uniform_real_distribution<dReal> uniform(0, 1);
+    vector<OpenRAVE::Transform> transforms;
+    for (int s = 0; s < samples; ++s) {
+      for (int d = 0; d < values.size(); ++d) {
+        // continuous joints have huge limits
+        dReal lo = lower[d], hi = upper[d];
+        if (hi - lo > 2*M_PI) { lo = -M_PI; hi = M_PI; }
+        values[d] = lo + (hi - lo)*uniform(rng);
+      }
+      body->SetDOFValues(values);
+      body->GetLinkTransformations(transforms);
+      for (int c = 0; c < nc; ++c)
+        links[c].setWorldTransform(util::toBtTransform(transforms[linkInds[c]], GeneralConfig::scale));
+      for (int i = 0; i < nc; ++i) {
+        btVector3 minA, maxA, minB, maxB;
+        links[i].getCollisionShape()->getAabb(links[i].getWorldTransform(), minA, maxA);
+        for (int j = i + 1; j < nc; ++j) {
+          if (!candidate[i*nc + j]) continue;
+          links[j].getCollisionShape()->getAabb(links[j].getWorldTransform(), minB, maxB);
+          if (TestAabbAgainstAabb2(minA, maxA, minB, maxB) && getEnvironment()->bullet->contactPairTestAny(&links[i], &links[j]))
+            ++touches[i*nc + j];
+        }
+      }
+    }
+  }
+
+  int n = 0;
+  for (int i = 0; i < nc; ++i) {
+    for (int j = i + 1; j < nc; ++j) {
+      if (candidate[i*nc + j] && (touches[i*nc + j] == 0 || touches[i*nc + j] == samples)) {
+        disableLinkPair(i, j);
+        ++n;
+      }
+    }
+  }
+  return n;
 }
 
 void RaveObject::initRaveObject(RaveInstance::Ptr rave_, KinBodyPtr body_,
 		TrimeshMode trimeshMode, bool isKinematic_) {
+  KinBodyGeometry geometry(body_, trimeshMode);
+  geometry.build();
+  initRaveObject(rave_, geometry, isKinematic_);
+}
+
+void RaveObject::initRaveObject(RaveInstance::Ptr rave_, const KinBodyGeometry &geometry, bool isKinematic_) {
+  KinBodyPtr body_ = geometry.body;
   vector<RaveLinkObject::Ptr> bulletLinks;
-  BOOST_FOREACH(KinBody::LinkPtr link, body_->GetLinks()) {
-    bulletLinks.push_back(createFromLink(rave_, link, subshapes, meshes, trimeshMode, isKinematic_));
+  const std::vector<KinBody::LinkPtr> &links = body_->GetLinks();
+  for (int i = 0; i < links.size(); ++i) {
+    bulletLinks.push_back(createFromLink(rave_, links[i], geometry.links[i], isKinematic_));
   }
 
   vector<BulletConstraint::Ptr> constraints_;
@@ -454,30 +659,37 @@ void RaveObject::initRaveObject(RaveInstance::Ptr rave_, KinBodyPtr body_,
 }
 
 bool RaveObject::detectCollisions() {
-	getEnvironment()->bullet->dynamicsWorld->updateAabbs();
+	// objects moved with setKinematicPos already refreshed their AABBs
+	updateAabbs();
+	ignoreCollisionObjs.update();
 
-	BulletInstance::CollisionObjectSet objs;
+	BulletInstance::Ptr bullet = getEnvironment()->bullet;
 	for (int i = 0; i < getChildren().size(); ++i) {
 		RaveLinkObject::Ptr child = getChildren()[i];
-		if (!child)
-			continue;
-		objs.clear();
-		getEnvironment()->bullet->contactTest(child->rigidBody.get(), objs,
-				&ignoreCollisionObjs);
-		if (!objs.empty()) {
-			// collision!
+		if (child && bullet->contactTestAny(child->rigidBody.get(), ignoreCollisionObjs))
 			return true;
-		}
 	}
 	return false;
 }
 
+void RaveObject::updateAabbs() {
+	if (!getEnvironment()) return;
+	btCollisionWorld *world = getEnvironment()->bullet->dynamicsWorld;
+	for (int i = 0; i < getChildren().size(); ++i) {
+		RaveLinkObject::Ptr child = getChildren()[i];
+		if (child && child->rigidBody->getBroadphaseHandle())
+			world->updateSingleAabb(child->rigidBody.get());
+	}
+}
+
 void RaveRobotObject::setDOFValues(const vector<int> &indices, const vector<dReal> &vals) {
 	robot->SetActiveDOFs(indices);
   robot->SetActiveDOFValues(vals);
 	updateBullet();
 	typedef map<RaveObject::Ptr, KinBody::LinkPtr>::value_type Targ2GrabberPair;
-	BOOST_FOREACH(Targ2GrabberPair& targ_grabber, m_targ2grabber) targ_grabber.first->updateBullet();
+	BOOST_FOREACH(Targ2GrabberPair& targ_grabber, m_targ2grabber) {
+		targ_grabber.first->updateBullet();
+	}
 }
 
 void RaveObject::prePhysics() {
@@ -494,16 +706,62 @@ void RaveObject::updateBullet() {
 	// update bullet structures
 	// we gave OpenRAVE the DOFs, now ask it for the equivalent transformations
 	// which are easy to feed into Bullet
+	raveStamp = body->GetUpdateStamp();
 	vector<OpenRAVE::Transform> transforms;
 	body->GetLinkTransformations(transforms);
-	const vector<KinBody::LinkPtr>& links = body->GetLinks();
+	const vector<int> &linkInds = getLinkIndsWithGeometry();
 
+	for (int i=0; i < children.size(); ++i)
+	  children[i]->motionState->setKinematicPos(util::toBtTransform(transforms[linkInds[i]],GeneralConfig::scale));
+}
+
+const vector<int> &RaveObject::getLinkIndsWithGeometry() {
 	if (linkIndsWithGeometry.size()==0) {
+	  const vector<KinBody::LinkPtr>& links = body->GetLinks();
 	  for (int i=0; i < links.size(); ++i) if (associatedObj(links[i])) linkIndsWithGeometry.push_back(i);
 	}
+	return linkIndsWithGeometry;
+}
 
-	for (int i=0; i < children.size(); ++i)
-	  children[i]->motionState->setKinematicPos(util::toBtTransform(transforms[linkIndsWithGeometry[i]],GeneralConfig::scale));
+static bool transformsDiffer(const btTransform &a, const btTransform &b, btScalar linThreshold, btScalar angThreshold) {
+  if ((a.getOrigin() - b.getOrigin()).length2() > linThreshold*linThreshold) return true;
+  for (int i = 0; i < 3; ++i) {
+    btVector3 d = (a.getBasis()[i] - b.getBasis()[i]).absolute();
+    if (d.x() > angThreshold || d.y() > angThreshold || d.z() > angThreshold) return true;
+  }
+  return false;
+}
+
+bool RaveObject::updateRaveIfMoved(btScalar threshold) {
+  bool synced = raveSyncedTransforms.size() == children.size();
+  if (synced) {
+    bool moved = false;
+    for (int i = 0; i < children.size() && !moved; ++i) {
+      btRigidBody *rb = children[i]->rigidBody.get();
+      moved = transformsDiffer(rb->getCenterOfMassTransform(), raveSyncedTransforms[i], threshold*METERS, threshold);
+    }
+    if (!moved) return false;
+  }
+
+  raveSyncedTransforms.resize(children.size());
+  for (int i = 0; i < children.size(); ++i) {
+    raveSyncedTransforms[i] = children[i]->rigidBody->getCenterOfMassTransform();
+  }
+  if (children.size() == 1) {
+    // same as updateRave
+    body->SetTransform(util::toRaveTransform(raveSyncedTransforms[0], 1/METERS));
+  } else {
+    for (int i = 0; i < children.size(); ++i) {
+      associatedObj(children[i]->rigidBody.get())->SetTransform(util::toRaveTransform(raveSyncedTransforms[i], 1/METERS));
+    }
+  }
+  return true;
+}
+
+bool RaveObject::updateBulletIfChanged() {
+  if (body->GetUpdateStamp() == raveStamp) return false;
+  updateBullet();
+  return true;
 }
 
 vector<double> RaveRobotObject::getDOFValues(const vector<int>& indices) {
@@ -526,7 +784,11 @@ void RaveObject::internalCopy(RaveObject::Ptr o, Fork &f) const {
 	  o->rave = f.rave;
 	}
 	else {
-	  o->rave.reset(new RaveInstance(*rave, OpenRAVE::Clone_Bodies));
+	  // clone the OpenRAVE environment only for the first object copied into this fork
+	  RaveInstance::Ptr &clone = f.raveCopies[rave.get()];
+	  if (!clone)
+	    clone.reset(new RaveInstance(*rave, OpenRAVE::Clone_Bodies));
+	  o->rave = clone;
 	}
 
 	// now we need to set up mappings in the copied robot
@@ -550,6 +812,7 @@ void RaveObject::internalCopy(RaveObject::Ptr o, Fork &f) const {
 	}
 
 	o->body = o->rave->env->GetKinBody(body->GetName());
+	o->disabledLinkPairs = disabledLinkPairs;
 }
 
 EnvironmentObject::Ptr RaveObject::copy(Fork &f) const {
@@ -574,9 +837,8 @@ EnvironmentObject::Ptr RaveRobotObject::copy(Fork &f) const {
 void RaveObject::postCopy(EnvironmentObject::Ptr copy, Fork &f) const {
 	Ptr o = boost::static_pointer_cast<RaveObject>(copy);
 
-	for (BulletInstance::CollisionObjectSet::const_iterator i =
-			ignoreCollisionObjs.begin(); i != ignoreCollisionObjs.end(); ++i)
-		o->ignoreCollisionObjs.insert((btCollisionObject *) f.copyOf(*i));
+	BOOST_FOREACH(const btCollisionObject *obj, ignoreCollisionObjs.getObjects())
+		o->ignoreCollisionObjs.insert((btCollisionObject *) f.copyOf(obj));
 }
 
 RaveRobotObject::RaveRobotObject(RaveInstance::Ptr rave_, RobotBasePtr robot_, TrimeshMode trimeshMode, bool isKinematic_) {
@@ -584,6 +846,11 @@ RaveRobotObject::RaveRobotObject(RaveInstance::Ptr rave_, RobotBasePtr robot_, T
 	initRaveObject(rave_, robot_, trimeshMode, isKinematic_);
 }
 
+RaveRobotObject::RaveRobotObject(RaveInstance::Ptr rave_, RobotBasePtr robot_, const KinBodyGeometry &geometry, bool isKinematic_) {
+	robot = robot_;
+	initRaveObject(rave_, geometry, isKinematic_);
+}
+
 RaveRobotObject::RaveRobotObject(RaveInstance::Ptr rave_, const std::string &uri, TrimeshMode trimeshMode, bool isKinematic_) {
 	robot = rave_->env->ReadRobotURI(uri);
 	initRaveObject(rave_, robot, trimeshMode, isKinematic_);
@@ -607,6 +874,78 @@ void RaveRobotObject::release(RaveObject::Ptr targ) {
   m_grabber2targ.erase(link);
 }
 
+namespace {
+// checks one waypoint of RaveRobotObject::checkTrajectory
+struct WaypointCheck {
+  ParallelContactTester &tester;
+  const vector<btCollisionShape *> &shapes;
+  const vector<btTransform> &poses; // shapes.size() per waypoint
+  const CollisionObjectMask &ignore;
+  int n;
+  bool continuous;
+  vector<char> *collides;
+  boost::mutex &mutex;
+  int &first;
+
+  void operator()(int i) const {
+    if (!collides) {
+      // an earlier waypoint already collides
+      boost::mutex::scoped_lock lock(mutex);
+      if (first >= 0 && first < i) return;
+    }
+    const int nc = shapes.size();
+    bool hit = false;
+    for (int c = 0; c < nc && !hit; ++c) {
+      hit = tester.contactTestAny(shapes[c], poses[i*nc + c], ignore);
+    }
+    if (continuous && i + 1 < n) {
+      for (int c = 0; c < nc && !hit; ++c) {
+        hit = tester.sweepTestAny(shapes[c], poses[i*nc + c], poses[(i+1)*nc + c], ignore);
+      }
+    }
+    if (collides) (*collides)[i] = hit;
+    if (hit) {
+      boost::mutex::scoped_lock lock(mutex);
+      if (first < 0 || i < first) first = i;
+    }
+  }
+};
+}
+
+int RaveRobotObject::checkTrajectory(const vector<int> &dofIndices, const dReal *traj, int n,
+                                     ParallelContactTester &tester, ThreadPool &threads, vector<char> *collides,
+                                     bool continuous) {
+  const int nc = children.size(), d = dofIndices.size();
+  vector<btCollisionShape *> shapes(nc);
+  for (int c = 0; c < nc; ++c) shapes[c] = children[c]->rigidBody->getCollisionShape();
+
+  // forward kinematics for all the waypoints at once, so OpenRAVE is only locked once
+  vector<btTransform> poses(n * nc);
+  {
+    EnvironmentMutex::scoped_lock lock(rave->env->GetMutex());
+    RobotBase::RobotStateSaver saver(robot);
+    robot->SetActiveDOFs(dofIndices);
+    const vector<int> &linkInds = getLinkIndsWithGeometry();
+    vector<dReal> vals(d);
+    vector<OpenRAVE::Transform> transforms;
+    for (int i = 0; i < n; ++i) {
+      vals.assign(traj + i*d, traj + (i+1)*d);
+      robot->SetActiveDOFValues(vals);
+      robot->GetLinkTransformations(transforms);
+      for (int c = 0; c < nc; ++c)
+        poses[i*nc + c] = util::toBtTransform(transforms[linkInds[c]], GeneralConfig::scale);
+    }
+  }
+
+  ignoreCollisionObjs.update();
+  if (collides) collides->assign(n, 0);
+  boost::mutex mutex;
+  int first = -1;
+  WaypointCheck check = {tester, shapes, poses, ignoreCollisionObjs, n, continuous, collides, mutex, first};
+  threads.parallelFor(n, check);
+  return first;
+}
+
 KinBody::LinkPtr RaveRobotObject::getGrabberLink(RaveObject::Ptr target) {
   return m_targ2grabber[target];
 }
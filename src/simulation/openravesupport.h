@@ -15,6 +15,8 @@ using namespace OpenRAVE;
 
 class RaveLinkObject;
 class RaveObject;
+class ParallelContactTester;
+class ThreadPool;
 
 struct RaveInstance {
   typedef boost::shared_ptr<RaveInstance> Ptr;
@@ -57,6 +59,27 @@ void GetLoadedBodies(Environment::Ptr env, std::set<string> &bodiesAlreadyLoaded
 enum TrimeshMode {
   CONVEX_HULL, // use btShapeHull
   RAW, // use btBvhTriangleMeshShape (not recommended, makes simulation very slow)
+  CONVEX_DECOMPOSITION, // compound of convex pieces from HACD, for concave meshes
+};
+
+// The collision shapes of a KinBody's links, built ahead of its RaveObject. Building them
+// only reads the links' geometry and the ShapeCache, so the links of a whole scene can be
+// built on worker threads (see LoadFromRaveExplicit); the rigid bodies are made afterwards,
+// on one thread, since Bullet's constructors aren't thread safe.
+struct LinkGeometry;
+struct KinBodyGeometry {
+  typedef boost::shared_ptr<KinBodyGeometry> Ptr;
+
+  KinBodyPtr body;
+  TrimeshMode trimeshMode;
+  // one per link of body, NULL if it has no geometry (or buildLink wasn't called yet)
+  std::vector<boost::shared_ptr<LinkGeometry> > links;
+
+  // doesn't build anything yet
+  KinBodyGeometry(KinBodyPtr body_, TrimeshMode trimeshMode_);
+  void buildLink(int i);
+  // all the links, on this thread
+  void build();
 };
 
 typedef CompoundObject<RaveLinkObject> CompoundRaveLinkObject;
@@ -71,6 +94,8 @@ public:
   RaveObject(RaveInstance::Ptr rave_, KinBodyPtr body_, const vector<RaveLinkObject::Ptr> &bulletLinks, const vector<BulletConstraint::Ptr> &constraints_, bool isKinematic_=true);
   // constructor that creates bullet objects for the links
   RaveObject(RaveInstance::Ptr rave_, KinBodyPtr body, TrimeshMode trimeshMode = CONVEX_HULL, bool isKinematic=true);
+  // same, with link shapes that were already built
+  RaveObject(RaveInstance::Ptr rave_, const KinBodyGeometry &geometry, bool isKinematic=true);
   // This constructor assumes the robot is already in openrave. Use this if you're loading a bunch of stuff from an
   // xml file, and you want to put everything in bullet
 
@@ -78,6 +103,10 @@ public:
   void destroy();
   void prePhysics();
 
+  // indexed by the KinBody's name and environment id
+  std::string getName() const { return body->GetName(); }
+  int getId() const { return body->GetEnvironmentId(); }
+
   // forking
   EnvironmentObject::Ptr copy(Fork &f) const;
   void postCopy(EnvironmentObject::Ptr copy, Fork &f) const;
@@ -101,9 +130,14 @@ public:
   }
 
   void ignoreCollisionWith(const btCollisionObject *obj) { ignoreCollisionObjs.insert(obj); }
-  // Returns true if the robot's current pose collides with anything in the environment
-  // (this will call updateAabbs() on the dynamicsWorld)
+  const CollisionObjectMask &getIgnoredCollisionObjs() const { return ignoreCollisionObjs; }
+  // Returns true if the robot's current pose collides with anything in the environment.
+  // Objects moved through their motion state's setKinematicPos (updateBullet, SetTransform)
+  // keep their broadphase AABBs current; anything moved by setting rigid body transforms
+  // directly needs updateAabbs() first.
   bool detectCollisions();
+  // refreshes the broadphase AABBs of the children after they were moved
+  void updateAabbs();
 
   // Positions the robot according to DOF values in the OpenRAVE model
   // and copy link positions to the Bullet rigid bodies.
@@ -111,14 +145,30 @@ public:
   // update's openrave stuff based on bullet
   void updateRave();
 
+  // Incremental versions of the two above, for syncing a whole scene. The caller
+  // should hold the OpenRAVE environment lock. Both return true if anything was written.
+  // updateRaveIfMoved writes the link transforms to OpenRAVE if some child has moved more
+  // than threshold (OpenRAVE units, and radians per rotation matrix entry) since the last
+  // time it was written. Sleeping children are compared too: a body may have moved and
+  // fallen asleep since.
+  bool updateRaveIfMoved(btScalar threshold);
+  // updateBulletIfChanged calls updateBullet if the KinBody's update stamp changed since
+  // the last updateBullet.
+  bool updateBulletIfChanged();
+
   bool getIsKinematic() const { return isKinematic; }
 
-protected:
-  // these two containers just keep track of the smart pointers
-  // so that the objects get deallocated on destruction
-  std::vector<boost::shared_ptr<btStridingMeshInterface> > meshes;
-  std::vector<boost::shared_ptr<btCollisionShape> > subshapes;
+  // Pairs of children (by index) that are kept from colliding with each other through the
+  // environment's pair filter while the object is in it: the adjacent links of the KinBody,
+  // and those found by disableNeverCollidingLinks.
+  const std::vector<std::pair<int, int> > &getDisabledLinkPairs() const { return disabledLinkPairs; }
+  void disableLinkPair(int i, int j);
+  // Sets the KinBody's DOFs to samples random values within their limits (restoring its
+  // state afterwards) and disables the link pairs that touched in none of them, or in all
+  // of them. Returns the number of pairs newly disabled. samples must be positive.
+  int disableNeverCollidingLinks(int samples);
 
+protected:
   // for looking up the associated Bullet object for an OpenRAVE link
   std::map<KinBody::LinkPtr, RaveLinkObject::Ptr> linkMap;
   std::vector<BulletConstraint::Ptr> constraints;
@@ -127,18 +177,27 @@ protected:
   // maps a child to a position in the children array. used for copying
   std::map<RaveLinkObject::Ptr, int> childPosMap;
 
-  // maps from child index to link index. only used in updateBullet
+  // maps from child index to link index. use getLinkIndsWithGeometry
   std::vector<int> linkIndsWithGeometry;
+  const std::vector<int> &getLinkIndsWithGeometry();
 
   // vector of objects to ignore collision with
-  BulletInstance::CollisionObjectSet ignoreCollisionObjs;
+  CollisionObjectMask ignoreCollisionObjs;
+
+  std::vector<std::pair<int, int> > disabledLinkPairs;
+
+  // children's transforms as last written by updateRaveIfMoved
+  std::vector<btTransform> raveSyncedTransforms;
+  // KinBody update stamp as of the last updateBullet, -1 if never
+  int raveStamp;
 
   // initializes the children vector with pre-created BulletObjects (bulletLinks.size() == body_->GetLinks().size()) and arbitrary constraints
   void initRaveObject(RaveInstance::Ptr rave_, KinBodyPtr body_, const vector<RaveLinkObject::Ptr> &bulletLinks, const vector<BulletConstraint::Ptr> &constraints_, bool isKinematic_);
   // for the loaded robot, this will create BulletObjects
   // and place them into the children vector
   void initRaveObject(RaveInstance::Ptr rave_, KinBodyPtr body_, TrimeshMode trimeshMode, bool isKinematic);
-  RaveObject() {} // for manual copying
+  void initRaveObject(RaveInstance::Ptr rave_, const KinBodyGeometry &geometry, bool isKinematic);
+  RaveObject() : raveStamp(-1) {} // for manual copying
   void internalCopy(RaveObject::Ptr o, Fork &f) const;
   bool isKinematic;
 };
@@ -156,6 +215,7 @@ public:
 
   RaveRobotObject(RaveInstance::Ptr rave_, RobotBasePtr robot, TrimeshMode trimeshMode = CONVEX_HULL, bool isStatic=true);
   RaveRobotObject(RaveInstance::Ptr rave_, const std::string &uri, TrimeshMode trimeshMode = CONVEX_HULL, bool isStatic=true);
+  RaveRobotObject(RaveInstance::Ptr rave_, RobotBasePtr robot, const KinBodyGeometry &geometry, bool isStatic=true);
 
   EnvironmentObject::Ptr copy(Fork &f) const;
 
@@ -181,6 +241,21 @@ public:
   RobotManipulatorPtr getManipByIndex(int i) const { return createdManips[i]; }
   RobotManipulatorPtr getManipByName(const std::string& name);
   int numCreatedManips() const { return createdManips.size(); }
+
+  // Collision checks a sequence of configurations of the given DOFs without moving anything
+  // in Bullet: traj holds n waypoints of dofIndices.size() values each. OpenRAVE computes
+  // the link poses of all waypoints first (under the environment lock, restoring the robot's
+  // state afterwards), then the waypoints are tested on threads against the rest of the
+  // scene as it is, like detectCollisions (grabbed objects stay where they are).
+  // If collides is given, every waypoint is checked and collides[i] is set for the ones
+  // that collide; otherwise checking stops at the first collision.
+  // With continuous, the links are also swept from each waypoint to the next (see
+  // ParallelContactTester::sweepTestAny), and waypoint i collides if the motion to i+1 does,
+  // so obstacles thinner than the spacing of the waypoints aren't missed.
+  // Returns the index of the first colliding waypoint, -1 if there's none.
+  int checkTrajectory(const vector<int> &dofIndices, const dReal *traj, int n,
+                      ParallelContactTester &tester, ThreadPool &threads, vector<char> *collides=NULL,
+                      bool continuous=false);
 protected:
   std::vector<RobotManipulatorPtr> createdManips;
   RaveRobotObject() {}
@@ -240,6 +315,7 @@ struct RobotManipulator {
 
 std::vector<RaveRobotObject::Ptr> getRobots(Environment::Ptr env, RaveInstance::Ptr rave);
 RaveObject::Ptr getObjectByName(Environment::Ptr env, RaveInstance::Ptr rave, const string& name);
+RaveObject::Ptr getObjectByKinBody(Environment::Ptr env, RaveInstance::Ptr rave, KinBodyPtr body);
 RaveRobotObject::Ptr getRobotByName(Environment::Ptr env, RaveInstance::Ptr rave, const string& name);
 
 class ScopedRobotSave {
@@ -0,0 +1,143 @@
+#include "profiler.h"
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+
+void StepProfiler::Stats::reset() {
+  count = 0;
+  last = total = max = 0;
+  min = DBL_MAX;
+  window.clear();
+  std::fill(histogram, histogram + NUM_BUCKETS, 0);
+}
+
+void StepProfiler::Stats::add(double x, bool isTime) {
+  if (window.size() < WINDOW_SIZE)
+    window.push_back(x);
+  else
+    window[count % WINDOW_SIZE] = x;
+  ++count;
+  last = x;
+  total += x;
+  min = std::min(min, x);
+  max = std::max(max, x);
+
+  // times are bucketed in microseconds, counts as they are
+  double v = isTime ? 1e6 * x : x;
+  int bucket = 0;
+  if (v >= 1) {
+    int exp;
+    frexp(v, &exp);
+    bucket = std::min(exp, NUM_BUCKETS - 1);
+  }
+  ++histogram[bucket];
+}
+
+double StepProfiler::Stats::percentile(double p) const {
+  if (window.empty()) return 0;
+  std::vector<double> sorted(window);
+  int k = std::max(0, std::min((int) sorted.size() - 1, (int) (p / 100. * sorted.size())));
+  std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+  return sorted[k];
+}
+
+StepProfiler::StepProfiler() : enabled(true), m_stepStart(0) {
+  std::fill(m_current, m_current + NUM_PHASES, 0);
+  std::fill(m_counts, m_counts + NUM_COUNTERS, 0);
+}
+
+void StepProfiler::beginStep() {
+  if (!enabled) return;
+  std::fill(m_current, m_current + NUM_PHASES, 0);
+  std::fill(m_counts, m_counts + NUM_COUNTERS, 0);
+  m_stepStart = now();
+}
+
+void StepProfiler::endStep() {
+  if (!enabled) return;
+  m_current[STEP] = now() - m_stepStart;
+  for (int i = 0; i < NUM_PHASES; ++i)
+    m_phaseStats[i].add(m_current[i], true);
+  for (int i = 0; i < NUM_COUNTERS; ++i)
+    m_counterStats[i].add(m_counts[i], false);
+}
+
+void StepProfiler::reset() {
+  for (int i = 0; i < NUM_PHASES; ++i)
+    m_phaseStats[i].reset();
+  for (int i = 0; i < NUM_COUNTERS; ++i)
+    m_counterStats[i].reset();
+}
+
+const char *StepProfiler::name(Phase phase) {
+  static const char *names[NUM_PHASES] = {
+    "step", "prePhysics", "predict", "broadphase", "narrowphase",
+    "islands", "solver", "integrate", "softBodies", "sdfGarbageCollect"
+  };
+  return names[phase];
+}
+
+const char *StepProfiler::name(Counter counter) {
+  static const char *names[NUM_COUNTERS] = {
+    "substeps", "overlappingPairs", "manifolds", "contacts"
+  };
+  return names[counter];
+}
+
+
+void ProfiledDynamicsWorld::performDiscreteCollisionDetection() {
+  // same as btCollisionWorld's, with the two halves timed separately
+  btDispatcherInfo &dispatchInfo = getDispatchInfo();
+  {
+    ScopedPhaseTimer t(profiler, StepProfiler::BROADPHASE);
+    updateAabbs();
+    m_broadphasePairCache->calculateOverlappingPairs(m_dispatcher1);
+  }
+  {
+    ScopedPhaseTimer t(profiler, StepProfiler::NARROWPHASE);
+    btDispatcher *dispatcher = getDispatcher();
+    if (dispatcher)
+      dispatcher->dispatchAllCollisionPairs(m_broadphasePairCache->getOverlappingPairCache(), dispatchInfo, m_dispatcher1);
+  }
+}
+
+// time spent in the phases that ProfiledDynamicsWorld times inside a substep
+static double innerTime(const StepProfiler &p) {
+  double t = 0;
+  for (int i = StepProfiler::PREDICT; i <= StepProfiler::INTEGRATE; ++i)
+    t += p.current((StepProfiler::Phase) i);
+  return t;
+}
+
+void ProfiledDynamicsWorld::internalSingleStepSimulation(btScalar timeStep) {
+  if (!profiler || !profiler->enabled) {
+    btSoftRigidDynamicsWorld::internalSingleStepSimulation(timeStep);
+    return;
+  }
+  // whatever the timed phases don't cover is soft body work (plus actions and activation updates)
+  double inner = innerTime(*profiler);
+  double start = StepProfiler::now();
+  btSoftRigidDynamicsWorld::internalSingleStepSimulation(timeStep);
+  double elapsed = StepProfiler::now() - start;
+  profiler->addTime(StepProfiler::SOFT_BODIES, elapsed - (innerTime(*profiler) - inner));
+}
+
+void ProfiledDynamicsWorld::predictUnconstraintMotion(btScalar timeStep) {
+  ScopedPhaseTimer t(profiler, StepProfiler::PREDICT);
+  btSoftRigidDynamicsWorld::predictUnconstraintMotion(timeStep);
+}
+
+void ProfiledDynamicsWorld::calculateSimulationIslands() {
+  ScopedPhaseTimer t(profiler, StepProfiler::ISLANDS);
+  btSoftRigidDynamicsWorld::calculateSimulationIslands();
+}
+
+void ProfiledDynamicsWorld::solveConstraints(btContactSolverInfo &solverInfo) {
+  ScopedPhaseTimer t(profiler, StepProfiler::SOLVER);
+  btSoftRigidDynamicsWorld::solveConstraints(solverInfo);
+}
+
+void ProfiledDynamicsWorld::integrateTransforms(btScalar timeStep) {
+  ScopedPhaseTimer t(profiler, StepProfiler::INTEGRATE);
+  btSoftRigidDynamicsWorld::integrateTransforms(timeStep);
+}
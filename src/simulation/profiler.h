@@ -0,0 +1,125 @@
+#pragma once
+#include <BulletSoftBody/btSoftRigidDynamicsWorld.h>
+#include <boost/shared_ptr.hpp>
+#include <vector>
+#include <time.h>
+
+// Per-phase timings and counters for Environment::step.
+// Unlike Bullet's CProfileManager this doesn't depend on BT_NO_PROFILE.
+// Timers accumulate into the current step between beginStep() and endStep();
+// endStep() folds the step into the statistics: last, min, max, mean,
+// a rolling window of the last WINDOW_SIZE steps (for percentiles)
+// and a histogram with power-of-two microsecond buckets over all steps.
+// Not thread safe; every BulletInstance has its own.
+class StepProfiler {
+public:
+  typedef boost::shared_ptr<StepProfiler> Ptr;
+
+  enum Phase {
+    STEP,         // all of Environment::step
+    PRE_PHYSICS,  // EnvironmentObject::prePhysics calls
+    PREDICT,      // applying gravity and predicting motion (rigid and soft)
+    BROADPHASE,   // aabb updates and pair finding
+    NARROWPHASE,  // dispatchAllCollisionPairs
+    ISLANDS,      // simulation island computation
+    SOLVER,       // constraint solver
+    INTEGRATE,    // integrating transforms
+    SOFT_BODIES,  // soft body solving and updates, actions, activation state
+    SDF_GC,       // sparse sdf garbage collection
+    NUM_PHASES
+  };
+  enum Counter {
+    SUBSTEPS,
+    OVERLAPPING_PAIRS,
+    MANIFOLDS,
+    CONTACTS,
+    NUM_COUNTERS
+  };
+  static const int WINDOW_SIZE = 256;
+  static const int NUM_BUCKETS = 24;
+
+  struct Stats {
+    long count;
+    double last, total, min, max;
+    std::vector<double> window;
+    unsigned long histogram[NUM_BUCKETS]; // bucket i counts values in [2^(i-1), 2^i) us; bucket 0 is < 1us
+    Stats() { reset(); }
+    void reset();
+    void add(double x, bool isTime);
+    double mean() const { return count ? total / count : 0; }
+    // percentile (0-100) over the rolling window
+    double percentile(double p) const;
+  };
+
+  StepProfiler();
+
+  bool enabled;
+
+  void beginStep();
+  void endStep();
+  void addTime(Phase phase, double seconds) { m_current[phase] += seconds; }
+  void setCount(Counter counter, double value) { m_counts[counter] = value; }
+  // time accumulated in the current step so far
+  double current(Phase phase) const { return m_current[phase]; }
+
+  const Stats &getStats(Phase phase) const { return m_phaseStats[phase]; }
+  const Stats &getStats(Counter counter) const { return m_counterStats[counter]; }
+  long numSteps() const { return m_phaseStats[STEP].count; }
+  void reset();
+
+  static const char *name(Phase phase);
+  static const char *name(Counter counter);
+
+  static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+  }
+
+private:
+  double m_current[NUM_PHASES];
+  double m_counts[NUM_COUNTERS];
+  double m_stepStart;
+  Stats m_phaseStats[NUM_PHASES];
+  Stats m_counterStats[NUM_COUNTERS];
+};
+
+// Adds the time until it goes out of scope to a phase. Does nothing if profiler is NULL or disabled.
+class ScopedPhaseTimer {
+public:
+  ScopedPhaseTimer(StepProfiler *profiler, StepProfiler::Phase phase) :
+    m_profiler(profiler && profiler->enabled ? profiler : NULL), m_phase(phase),
+    m_start(m_profiler ? StepProfiler::now() : 0) { }
+  ~ScopedPhaseTimer() {
+    if (m_profiler) m_profiler->addTime(m_phase, StepProfiler::now() - m_start);
+  }
+private:
+  StepProfiler *m_profiler;
+  StepProfiler::Phase m_phase;
+  double m_start;
+};
+
+// btSoftRigidDynamicsWorld that reports the time spent in each part of a substep to a StepProfiler
+class ProfiledDynamicsWorld : public btSoftRigidDynamicsWorld {
+public:
+  StepProfiler *profiler;
+
+  ProfiledDynamicsWorld(btDispatcher *dispatcher, btBroadphaseInterface *pairCache,
+      btConstraintSolver *constraintSolver, btCollisionConfiguration *collisionConfiguration,
+      StepProfiler *profiler_) :
+    btSoftRigidDynamicsWorld(dispatcher, pairCache, constraintSolver, collisionConfiguration),
+    profiler(profiler_) { }
+
+  virtual void performDiscreteCollisionDetection();
+
+  // time stepSimulation has accumulated but not simulated yet (less than one fixed substep)
+  btScalar getLocalTime() const { return m_localTime; }
+  void setLocalTime(btScalar localTime) { m_localTime = localTime; }
+
+protected:
+  virtual void internalSingleStepSimulation(btScalar timeStep);
+  virtual void predictUnconstraintMotion(btScalar timeStep);
+  virtual void calculateSimulationIslands();
+  virtual void solveConstraints(btContactSolverInfo &solverInfo);
+  virtual void integrateTransforms(btScalar timeStep);
+};
@@ -0,0 +1,468 @@
+#include "shape_cache.h"
+#include "config_bullet.h"
+#include "logging.h"
+#include <BulletCollision/CollisionShapes/btShapeHull.h>
+#include <hacdHACD.h>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/format.hpp>
+#include <boost/functional/hash.hpp>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+
+namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+// bump when the file layout or the way results are computed changes
+static const char FILE_MAGIC[8] = {'B', 'S', 'C', 'A', 'C', 'H', 'E', '2'};
+static const char BVH_FILE_MAGIC[8] = {'B', 'S', 'B', 'V', 'H', '0', '0', '1'};
+
+ShapeCache &ShapeCache::instance() {
+  static ShapeCache cache;
+  return cache;
+}
+
+ShapeCache::ShapeCache() {
+  m_stats.memoryHits = m_stats.diskHits = m_stats.misses = 0;
+}
+
+ShapeCache::Key ShapeCache::hash(const void *data, size_t len, Key h) {
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < len; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+ShapeCache::IndexedMeshPtr ShapeCache::findMesh(Key key) {
+  boost::mutex::scoped_lock lock(m_mutex);
+  boost::unordered_map<Key, boost::weak_ptr<const IndexedMesh> >::iterator i = m_meshes.find(key);
+  if (i == m_meshes.end()) return IndexedMeshPtr();
+  IndexedMeshPtr mesh = i->second.lock();
+  if (!mesh) m_meshes.erase(i);
+  return mesh;
+}
+
+namespace {
+struct VertexKey {
+  btScalar x, y, z;
+  bool operator==(const VertexKey &o) const { return x == o.x && y == o.y && z == o.z; }
+};
+std::size_t hash_value(const VertexKey &v) {
+  std::size_t seed = 0;
+  boost::hash_combine(seed, v.x);
+  boost::hash_combine(seed, v.y);
+  boost::hash_combine(seed, v.z);
+  return seed;
+}
+}
+
+ShapeCache::IndexedMeshPtr ShapeCache::addMesh(Key key, const Points &vertices, const std::vector<int> &indices) {
+  boost::shared_ptr<IndexedMesh> mesh(new IndexedMesh);
+  mesh->key = key;
+  mesh->indices.resize(indices.size() / 3 * 3);
+  mesh->vertices.reserve(3*vertices.size());
+
+  // merge duplicate vertices, renumbering the indices
+  boost::unordered_map<VertexKey, int> seen;
+  std::vector<int> newIndex(vertices.size(), -1);
+  for (size_t i = 0; i < mesh->indices.size(); ++i) {
+    int j = indices[i];
+    if (j < 0 || j >= (int) vertices.size()) {
+      LOG_WARN("mesh index " << j << " out of range (" << vertices.size() << " vertices)");
+      return IndexedMeshPtr();
+    }
+    if (newIndex[j] < 0) {
+      VertexKey v = {vertices[j].x(), vertices[j].y(), vertices[j].z()};
+      std::pair<boost::unordered_map<VertexKey, int>::iterator, bool> ins = seen.insert(std::make_pair(v, mesh->numVertices()));
+      if (ins.second) {
+        mesh->vertices.push_back(v.x);
+        mesh->vertices.push_back(v.y);
+        mesh->vertices.push_back(v.z);
+      }
+      newIndex[j] = ins.first->second;
+    }
+    mesh->indices[i] = newIndex[j];
+  }
+
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_meshes[key] = mesh;
+  return mesh;
+}
+
+ShapeCache::Key ShapeCache::hullKey(Key meshKey, btScalar margin) {
+  Key key = hash("hull", 4, HASH_INIT);
+  key = hash(&margin, sizeof(margin), key);
+  return hash(&meshKey, sizeof(meshKey), key);
+}
+
+ShapeCache::PointsPtr ShapeCache::findHull(Key key, const std::string &file) {
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    boost::unordered_map<Key, PointsPtr>::iterator i = m_hulls.find(key);
+    if (i != m_hulls.end()) {
+      ++m_stats.memoryHits;
+      return i->second;
+    }
+  }
+  Pieces pieces;
+  if (file.empty() || !readPieces(file, pieces)) return PointsPtr();
+  if (pieces.size() != 1) {
+    LOG_WARN("ignoring shape cache file " << file << ": expected a single hull");
+    return PointsPtr();
+  }
+  boost::shared_ptr<Points> points(new Points);
+  points->swap(pieces[0]);
+  boost::mutex::scoped_lock lock(m_mutex);
+  ++m_stats.diskHits;
+  m_hulls[key] = points;
+  return points;
+}
+
+ShapeCache::PointsPtr ShapeCache::findConvexHull(Key meshKey, btScalar margin) {
+  Key key = hullKey(meshKey, margin);
+  return findHull(key, filename("hull", key));
+}
+
+ShapeCache::Points ShapeCache::hullPoints(btConvexShape &shape, btScalar margin) {
+  shape.setMargin(margin);
+  btShapeHull hull(&shape);
+  hull.buildHull(-666); // note: margin argument not used
+  return Points(hull.getVertexPointer(), hull.getVertexPointer() + hull.numVertices());
+}
+
+ShapeCache::PointsPtr ShapeCache::convexHull(IndexedMeshPtr mesh, btScalar margin) {
+  Key key = hullKey(mesh->key, margin);
+  std::string file = filename("hull", key);
+  PointsPtr found = findHull(key, file);
+  if (found) return found;
+
+  SharedTriangleMesh trimesh(mesh);
+  btConvexTriangleMeshShape convexBuilder(&trimesh);
+  boost::shared_ptr<Points> points(new Points(hullPoints(convexBuilder, margin)));
+  if (!file.empty()) writePieces(file, Pieces(1, *points));
+
+  boost::mutex::scoped_lock lock(m_mutex);
+  ++m_stats.misses;
+  m_hulls[key] = points;
+  return points;
+}
+
+ShapeCache::Key ShapeCache::decompositionKey(Key meshKey, btScalar margin, const DecompositionParams &params) {
+  Key key = hash("hacd", 4, HASH_INIT);
+  key = hash(&margin, sizeof(margin), key);
+  key = hash(&params.minClusters, sizeof(params.minClusters), key);
+  key = hash(&params.maxVerticesPerHull, sizeof(params.maxVerticesPerHull), key);
+  key = hash(&params.concavity, sizeof(params.concavity), key);
+  return hash(&meshKey, sizeof(meshKey), key);
+}
+
+ShapeCache::PiecesPtr ShapeCache::findDecomposition(Key key, const std::string &file) {
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    boost::unordered_map<Key, PiecesPtr>::iterator i = m_decompositions.find(key);
+    if (i != m_decompositions.end()) {
+      ++m_stats.memoryHits;
+      return i->second;
+    }
+  }
+  boost::shared_ptr<Pieces> pieces(new Pieces);
+  if (file.empty() || !readPieces(file, *pieces)) return PiecesPtr();
+  boost::mutex::scoped_lock lock(m_mutex);
+  ++m_stats.diskHits;
+  m_decompositions[key] = pieces;
+  return pieces;
+}
+
+ShapeCache::PiecesPtr ShapeCache::findConvexDecomposition(Key meshKey, btScalar margin, const DecompositionParams &params) {
+  Key key = decompositionKey(meshKey, margin, params);
+  return findDecomposition(key, filename("hacd", key));
+}
+
+ShapeCache::PiecesPtr ShapeCache::convexDecomposition(IndexedMeshPtr mesh, btScalar margin, const DecompositionParams &params) {
+  Key key = decompositionKey(mesh->key, margin, params);
+  std::string file = filename("hacd", key);
+  PiecesPtr found = findDecomposition(key, file);
+  if (found) return found;
+
+  std::vector<HACD::Vec3<HACD::Real> > points(mesh->numVertices());
+  for (int i = 0; i < mesh->numVertices(); ++i) {
+    points[i] = HACD::Vec3<HACD::Real>(mesh->vertices[3*i], mesh->vertices[3*i+1], mesh->vertices[3*i+2]);
+  }
+  std::vector<HACD::Vec3<long> > triangles(mesh->numTriangles());
+  for (int i = 0; i < mesh->numTriangles(); ++i) {
+    triangles[i] = HACD::Vec3<long>(mesh->indices[3*i], mesh->indices[3*i+1], mesh->indices[3*i+2]);
+  }
+
+  // settings from Bullet's ConvexDecompositionDemo, apart from the ones in params
+  HACD::HACD hacd;
+  hacd.SetPoints(points.empty() ? NULL : &points[0]);
+  hacd.SetNPoints(points.size());
+  hacd.SetTriangles(triangles.empty() ? NULL : &triangles[0]);
+  hacd.SetNTriangles(triangles.size());
+  hacd.SetCompacityWeight(0.1);
+  hacd.SetVolumeWeight(0.0);
+  hacd.SetNClusters(params.minClusters);
+  hacd.SetNVerticesPerCH(params.maxVerticesPerHull);
+  hacd.SetConcavity(params.concavity);
+  hacd.SetAddExtraDistPoints(false);
+  hacd.SetAddNeighboursDistPoints(false);
+  hacd.SetAddFacesPoints(false);
+
+  boost::shared_ptr<Pieces> pieces(new Pieces);
+  if (!triangles.empty() && hacd.Compute()) {
+    pieces->reserve(hacd.GetNClusters());
+    for (size_t c = 0; c < hacd.GetNClusters(); ++c) {
+      std::vector<HACD::Vec3<HACD::Real> > pointsCH(hacd.GetNPointsCH(c));
+      std::vector<HACD::Vec3<long> > trianglesCH(hacd.GetNTrianglesCH(c));
+      if (pointsCH.empty() || trianglesCH.empty()) continue;
+      hacd.GetCH(c, &pointsCH[0], &trianglesCH[0]);
+      btConvexHullShape piece;
+      for (size_t i = 0; i < pointsCH.size(); ++i) {
+        piece.addPoint(btVector3(pointsCH[i].X(), pointsCH[i].Y(), pointsCH[i].Z()));
+      }
+      pieces->push_back(hullPoints(piece, margin));
+    }
+  }
+  if (pieces->empty()) {
+    // degenerate input: fall back to a single hull
+    LOG_WARN("convex decomposition failed, using the convex hull instead");
+    pieces->push_back(*convexHull(mesh, margin));
+  }
+  if (!file.empty()) writePieces(file, *pieces);
+
+  boost::mutex::scoped_lock lock(m_mutex);
+  ++m_stats.misses;
+  m_decompositions[key] = pieces;
+  return pieces;
+}
+
+ShapeCache::Key ShapeCache::bvhKey(Key meshKey) {
+  Key key = hash("bvh", 3, HASH_INIT);
+  return hash(&meshKey, sizeof(meshKey), key);
+}
+
+ShapeCache::BvhPtr ShapeCache::findBvh(Key key, const std::string &file) {
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    boost::unordered_map<Key, boost::weak_ptr<btOptimizedBvh> >::iterator i = m_bvhs.find(key);
+    if (i != m_bvhs.end()) {
+      BvhPtr bvh = i->second.lock();
+      if (bvh) {
+        ++m_stats.memoryHits;
+        return bvh;
+      }
+      m_bvhs.erase(i);
+    }
+  }
+  BvhPtr bvh;
+  if (file.empty() || !(bvh = readBvh(file))) return BvhPtr();
+  boost::mutex::scoped_lock lock(m_mutex);
+  ++m_stats.diskHits;
+  m_bvhs[key] = bvh;
+  return bvh;
+}
+
+ShapeCache::BvhPtr ShapeCache::bvh(IndexedMeshPtr mesh) {
+  Key key = bvhKey(mesh->key);
+  std::string file = filename("bvh", key);
+  BvhPtr found = findBvh(key, file);
+  if (found) return found;
+
+  // build it the way btBvhTriangleMeshShape::buildOptimizedBvh does
+  SharedTriangleMesh trimesh(mesh);
+  btBvhTriangleMeshShape bounds(&trimesh, true, false);
+  BvhPtr bvh(new btOptimizedBvh());
+  bvh->build(&trimesh, true, bounds.getLocalAabbMin(), bounds.getLocalAabbMax());
+  if (!file.empty()) writeBvh(file, *bvh);
+
+  boost::mutex::scoped_lock lock(m_mutex);
+  ++m_stats.misses;
+  m_bvhs[key] = bvh;
+  return bvh;
+}
+
+void ShapeCache::clear() {
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_meshes.clear();
+  m_hulls.clear();
+  m_decompositions.clear();
+  m_bvhs.clear();
+}
+
+ShapeCache::Stats ShapeCache::stats() {
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_stats;
+}
+
+std::string ShapeCache::filename(const char *kind, Key key) {
+  if (BulletConfig::shapeCacheDir.empty()) return std::string();
+  return (fs::path(BulletConfig::shapeCacheDir) / (boost::format("%s_%016x.bin") % kind % key).str()).string();
+}
+
+bool ShapeCache::readPieces(const std::string &filename, Pieces &out) {
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if (!in) return false;
+  char magic[8];
+  boost::uint32_t scalarSize, numPieces;
+  in.read(magic, 8);
+  in.read((char *) &scalarSize, sizeof(scalarSize));
+  in.read((char *) &numPieces, sizeof(numPieces));
+  if (!in || memcmp(magic, FILE_MAGIC, 8) != 0 || scalarSize != sizeof(btScalar)) {
+    LOG_WARN("ignoring shape cache file " << filename << ": bad header");
+    return false;
+  }
+  // piece sizes are checked against what's left of the file before allocating
+  std::streamoff pos = in.tellg();
+  in.seekg(0, std::ios::end);
+  std::streamoff end = in.tellg();
+  in.seekg(pos);
+  out.clear();
+  std::vector<btScalar> data;
+  for (boost::uint32_t p = 0; p < numPieces && in; ++p) {
+    boost::uint32_t n;
+    in.read((char *) &n, sizeof(n));
+    if (!in) break;
+    if ((boost::uint64_t) n * 3 * sizeof(btScalar) > (boost::uint64_t) (end - in.tellg())) {
+      LOG_WARN("ignoring shape cache file " << filename << ": bad piece size");
+      return false;
+    }
+    data.resize(3*n);
+    if (n > 0) in.read((char *) &data[0], data.size()*sizeof(btScalar));
+    out.push_back(Points(n));
+    for (size_t i = 0; i < n; ++i) {
+      out.back()[i].setValue(data[3*i], data[3*i+1], data[3*i+2]);
+    }
+  }
+  if (!in) {
+    LOG_WARN("ignoring shape cache file " << filename << ": truncated");
+    return false;
+  }
+  return true;
+}
+
+void ShapeCache::writePieces(const std::string &filename, const Pieces &pieces) {
+  std::ostringstream out;
+  boost::uint32_t scalarSize = sizeof(btScalar), numPieces = pieces.size();
+  out.write(FILE_MAGIC, 8);
+  out.write((const char *) &scalarSize, sizeof(scalarSize));
+  out.write((const char *) &numPieces, sizeof(numPieces));
+  for (size_t p = 0; p < pieces.size(); ++p) {
+    boost::uint32_t n = pieces[p].size();
+    out.write((const char *) &n, sizeof(n));
+    for (size_t i = 0; i < pieces[p].size(); ++i) {
+      out.write((const char *) pieces[p][i].m_floats, 3*sizeof(btScalar));
+    }
+  }
+  writeFile(filename, out.str());
+}
+
+namespace {
+// header of a BVH file, followed by the btOptimizedBvh serialization. 16 bytes, so the
+// serialized data is 16-byte aligned in the (page aligned) mapping
+struct BvhFileHeader {
+  char magic[8];
+  boost::uint16_t scalarSize, pointerSize;
+  boost::uint32_t size;
+};
+
+// the mapped object was constructed in place: destroy it, then unmap the file
+struct MappedBvhDeleter {
+  boost::shared_ptr<bip::mapped_region> region;
+  void operator()(btOptimizedBvh *bvh) { bvh->~btOptimizedBvh(); }
+};
+}
+
+ShapeCache::BvhPtr ShapeCache::readBvh(const std::string &filename) {
+  boost::shared_ptr<bip::mapped_region> region;
+  try {
+    if (!fs::exists(filename)) return BvhPtr();
+    bip::file_mapping file(filename.c_str(), bip::read_only);
+    region.reset(new bip::mapped_region(file, bip::copy_on_write));
+  } catch (const std::exception &e) {
+    LOG_WARN("couldn't map shape cache file " << filename << ": " << e.what());
+    return BvhPtr();
+  }
+
+  char *data = static_cast<char *>(region->get_address());
+  const BvhFileHeader *header = reinterpret_cast<const BvhFileHeader *>(data);
+  if (region->get_size() < sizeof(BvhFileHeader) || memcmp(header->magic, BVH_FILE_MAGIC, 8) != 0
+      || header->scalarSize != sizeof(btScalar) || header->pointerSize != sizeof(void *)) {
+    LOG_WARN("ignoring shape cache file " << filename << ": bad header");
+    return BvhPtr();
+  }
+  if (region->get_size() - sizeof(BvhFileHeader) < header->size) {
+    LOG_WARN("ignoring shape cache file " << filename << ": truncated");
+    return BvhPtr();
+  }
+  btOptimizedBvh *bvh = btOptimizedBvh::deSerializeInPlace(data + sizeof(BvhFileHeader), header->size, false);
+  if (!bvh) {
+    LOG_WARN("ignoring shape cache file " << filename << ": bad BVH data");
+    return BvhPtr();
+  }
+  MappedBvhDeleter deleter = {region};
+  return BvhPtr(bvh, deleter);
+}
+
+void ShapeCache::writeBvh(const std::string &filename, const btOptimizedBvh &bvh) {
+  BvhFileHeader header;
+  memcpy(header.magic, BVH_FILE_MAGIC, 8);
+  header.scalarSize = sizeof(btScalar);
+  header.pointerSize = sizeof(void *);
+  header.size = bvh.calculateSerializeBufferSize();
+  // the serializer wants an aligned buffer
+  void *buffer = btAlignedAlloc(header.size, 16);
+  bool ok = bvh.serializeInPlace(buffer, header.size, false);
+  std::string data;
+  if (ok) {
+    data.reserve(sizeof(header) + header.size);
+    data.append((const char *) &header, sizeof(header));
+    data.append((const char *) buffer, header.size);
+  }
+  btAlignedFree(buffer);
+  if (ok) writeFile(filename, data);
+  else LOG_WARN("couldn't serialize BVH for " << filename);
+}
+
+void ShapeCache::writeFile(const std::string &filename, const std::string &data) {
+  // write to a temporary file and rename it into place, so that other
+  // processes never see a partial file
+  try {
+    fs::path path(filename);
+    fs::create_directories(path.parent_path());
+    fs::path tmp = fs::unique_path(path.string() + ".%%%%%%%%.tmp");
+    {
+      std::ofstream out(tmp.string().c_str(), std::ios::binary);
+      out.write(data.data(), data.size());
+      if (!out) {
+        LOG_WARN("couldn't write shape cache file " << tmp.string());
+        out.close();
+        fs::remove(tmp);
+        return;
+      }
+    }
+    fs::rename(tmp, path);
+  } catch (const fs::filesystem_error &e) {
+    LOG_WARN("couldn't write shape cache file " << filename << ": " << e.what());
+  }
+}
+
+SharedTriangleMesh::SharedTriangleMesh(ShapeCache::IndexedMeshPtr mesh) : m_mesh(mesh) {
+  // Bullet only reads through these pointers (we never lock the mesh for writing)
+  btIndexedMesh part;
+  part.m_numTriangles = mesh->numTriangles();
+  part.m_triangleIndexBase = (const unsigned char *) (mesh->indices.empty() ? NULL : &mesh->indices[0]);
+  part.m_triangleIndexStride = 3*sizeof(int);
+  part.m_numVertices = mesh->numVertices();
+  part.m_vertexBase = (const unsigned char *) (mesh->vertices.empty() ? NULL : &mesh->vertices[0]);
+  part.m_vertexStride = 3*sizeof(btScalar);
+  addIndexedMesh(part, PHY_INTEGER);
+}
+
+SharedBvhTriangleMeshShape::SharedBvhTriangleMeshShape(SharedTriangleMesh *mesh, ShapeCache::BvhPtr bvh)
+  : btBvhTriangleMeshShape(mesh, true, false), m_sharedBvh(bvh) {
+  setOptimizedBvh(bvh.get());
+}
@@ -0,0 +1,160 @@
+#pragma once
+#include <btBulletDynamicsCommon.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/cstdint.hpp>
+#include <string>
+#include <vector>
+
+// Process-wide cache for collision shape preprocessing that only depends on mesh data,
+// so loading the same model again (into another environment, or in another process)
+// doesn't redo it. Entries are keyed by a hash of the input and of the parameters
+// that affect the result.
+// Indexed meshes and their BVHs are shared for as long as some shape uses them. BVHs are
+// also stored in the cache directory and mapped back into memory. Convex hulls and
+// convex decompositions stay in memory for the life of the process and, if
+// BulletConfig::shapeCacheDir is set, are also stored in files in that directory.
+// Files that can't be read or don't match are ignored and rewritten.
+// Thread safe. The work on a miss is done outside the lock, so two threads missing
+// on the same key both compute it.
+class ShapeCache {
+public:
+  typedef boost::uint64_t Key;
+  typedef std::vector<btVector3> Points;
+  typedef boost::shared_ptr<const Points> PointsPtr;
+  typedef std::vector<Points> Pieces;
+  typedef boost::shared_ptr<const Pieces> PiecesPtr;
+  // shared between shapes, so it must not be refit
+  typedef boost::shared_ptr<btOptimizedBvh> BvhPtr;
+
+  // triangle mesh with duplicate vertices merged, in world units
+  struct IndexedMesh {
+    Key key;
+    std::vector<btScalar> vertices; // 3 per vertex
+    std::vector<int> indices;       // 3 per triangle
+    int numVertices() const { return vertices.size() / 3; }
+    int numTriangles() const { return indices.size() / 3; }
+  };
+  typedef boost::shared_ptr<const IndexedMesh> IndexedMeshPtr;
+
+  // see the HACD documentation
+  struct DecompositionParams {
+    int minClusters;
+    int maxVerticesPerHull;
+    double concavity;
+  };
+
+  struct Stats {
+    long memoryHits, diskHits, misses;
+  };
+
+  static ShapeCache &instance();
+
+  // key of the mesh that indexedMesh returns for the same arguments, without building it.
+  // VectorT needs x, y and z members (e.g. OpenRAVE::Vector)
+  template<typename VectorT>
+  static Key meshKey(const std::vector<VectorT> &vertices, const std::vector<int> &indices, btScalar scale);
+  // the mesh given by vertices * scale and indices (3 per triangle), with duplicate vertices merged.
+  // NULL if an index is out of range
+  template<typename VectorT>
+  IndexedMeshPtr indexedMesh(const std::vector<VectorT> &vertices, const std::vector<int> &indices, btScalar scale);
+
+  // vertices of the convex hull (btShapeHull) of a mesh, with the hull built at the given margin
+  PointsPtr convexHull(IndexedMeshPtr mesh, btScalar margin);
+  // same, but only looking in the cache. NULL on a miss
+  PointsPtr findConvexHull(Key meshKey, btScalar margin);
+
+  // approximate convex decomposition of a mesh (HACD): the vertices of each piece, in the
+  // mesh frame, with each piece's hull built at the given margin
+  PiecesPtr convexDecomposition(IndexedMeshPtr mesh, btScalar margin, const DecompositionParams &params);
+  // same, but only looking in the cache. NULL on a miss
+  PiecesPtr findConvexDecomposition(Key meshKey, btScalar margin, const DecompositionParams &params);
+
+  // quantized BVH over a mesh, the same one btBvhTriangleMeshShape builds
+  BvhPtr bvh(IndexedMeshPtr mesh);
+
+  // drops the in-memory entries (files are kept)
+  void clear();
+  Stats stats();
+
+  // FNV-1a, continuing from h
+  static Key hash(const void *data, size_t len, Key h);
+  static const Key HASH_INIT = 14695981039346656037ULL;
+
+private:
+  ShapeCache();
+  ShapeCache(const ShapeCache &);
+  ShapeCache &operator=(const ShapeCache &);
+
+  boost::mutex m_mutex;
+  boost::unordered_map<Key, boost::weak_ptr<const IndexedMesh> > m_meshes;
+  boost::unordered_map<Key, PointsPtr> m_hulls;
+  boost::unordered_map<Key, PiecesPtr> m_decompositions;
+  boost::unordered_map<Key, boost::weak_ptr<btOptimizedBvh> > m_bvhs;
+  Stats m_stats;
+
+  IndexedMeshPtr findMesh(Key key);
+  IndexedMeshPtr addMesh(Key key, const Points &vertices, const std::vector<int> &indices);
+  static Key hullKey(Key meshKey, btScalar margin);
+  PointsPtr findHull(Key key, const std::string &file);
+  static Key decompositionKey(Key meshKey, btScalar margin, const DecompositionParams &params);
+  PiecesPtr findDecomposition(Key key, const std::string &file);
+  static Points hullPoints(btConvexShape &shape, btScalar margin);
+  static Key bvhKey(Key meshKey);
+  BvhPtr findBvh(Key key, const std::string &file);
+
+  // empty if there's no cache directory
+  static std::string filename(const char *kind, Key key);
+  // a file holds a list of point sets (one for a hull)
+  static bool readPieces(const std::string &filename, Pieces &out);
+  static void writePieces(const std::string &filename, const Pieces &pieces);
+  // the file is mapped copy-on-write, since deserializing patches the header in place
+  static BvhPtr readBvh(const std::string &filename);
+  static void writeBvh(const std::string &filename, const btOptimizedBvh &bvh);
+  static void writeFile(const std::string &filename, const std::string &data);
+};
+
+// btTriangleIndexVertexArray over the arrays of a shared IndexedMesh, which it keeps alive
+class SharedTriangleMesh : public btTriangleIndexVertexArray {
+public:
+  explicit SharedTriangleMesh(ShapeCache::IndexedMeshPtr mesh);
+  ShapeCache::IndexedMeshPtr getMesh() const { return m_mesh; }
+private:
+  ShapeCache::IndexedMeshPtr m_mesh;
+};
+
+// btBvhTriangleMeshShape using the cached BVH of a shared mesh, which it keeps alive
+class SharedBvhTriangleMeshShape : public btBvhTriangleMeshShape {
+public:
+  SharedBvhTriangleMeshShape(SharedTriangleMesh *mesh, ShapeCache::BvhPtr bvh);
+private:
+  ShapeCache::BvhPtr m_sharedBvh;
+};
+
+
+template<typename VectorT>
+ShapeCache::Key ShapeCache::meshKey(const std::vector<VectorT> &vertices, const std::vector<int> &indices, btScalar scale) {
+  Key key = hash("mesh", 4, HASH_INIT);
+  key = hash(&scale, sizeof(scale), key);
+  for (size_t i = 0; i < vertices.size(); ++i) {
+    key = hash(&vertices[i].x, sizeof(vertices[i].x), key);
+    key = hash(&vertices[i].y, sizeof(vertices[i].y), key);
+    key = hash(&vertices[i].z, sizeof(vertices[i].z), key);
+  }
+  if (!indices.empty()) key = hash(&indices[0], indices.size()*sizeof(int), key);
+  return key;
+}
+
+template<typename VectorT>
+ShapeCache::IndexedMeshPtr ShapeCache::indexedMesh(const std::vector<VectorT> &vertices, const std::vector<int> &indices, btScalar scale) {
+  Key key = meshKey(vertices, indices, scale);
+  IndexedMeshPtr mesh = findMesh(key);
+  if (mesh) return mesh;
+  Points scaled(vertices.size());
+  for (size_t i = 0; i < vertices.size(); ++i) {
+    scaled[i] = btVector3(vertices[i].x, vertices[i].y, vertices[i].z) * scale;
+  }
+  return addMesh(key, scaled, indices);
+}
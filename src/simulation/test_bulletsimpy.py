@@ -40,6 +40,23 @@ T = mug1.GetTransform()
 T[:3,3] += [0, 0, 1]
 mug1.SetTransform(T)
 
+# batched state access, one call for all the dynamic objects
+Ts = bullet_env.GetTransforms()
+assert Ts.shape == (len(dyn_obj_names), 4, 4)
+bullet_env.SetTransforms(None, Ts)
+print 'linear velocities:', bullet_env.GetLinearVelocities(dyn_objs)
+bullet_env.SetAngularVelocities(dyn_objs, bullet_env.GetAngularVelocities(dyn_objs) * 0)
+
+# float64 input (numpy's default) is cast like float32
+import numpy as np
+T64 = np.array(T, dtype=np.float64)
+T64[:3,3] += [0, 0, .5]
+mug1.SetTransform(T64)
+assert np.allclose(mug1.GetTransform(), T64, atol=1e-5)
+bullet_env.SetTransforms(None, np.array(Ts, dtype=np.float64))
+assert np.allclose(bullet_env.GetTransforms(), Ts, atol=1e-5)
+bullet_env.SetLinearVelocities(dyn_objs, np.zeros((len(dyn_objs), 3)))
+
 for t in range(TIMESTEPS):
   print t
 
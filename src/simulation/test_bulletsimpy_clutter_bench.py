@@ -0,0 +1,39 @@
+import openravepy
+import bulletsimpy
+import numpy as np
+import time
+
+# compares stepping speed of a cluttered tabletop (many convex hull mugs piled up on the table)
+# with the narrowphase on the calling thread and on several threads
+
+env = openravepy.Environment()
+env.Load('data/table.xml')
+
+# a few layers of mugs, close enough that they fall onto each other
+n_mugs = 150
+for i in range(n_mugs):
+  mug = env.ReadKinBodyURI('data/mug1.kinbody.xml')
+  mug.SetName('mug_%d' % i)
+  env.Add(mug)
+  layer, j = i // 50, i % 50
+  angle = .3*i
+  mug.SetTransform(openravepy.matrixFromPose(np.r_[np.cos(angle/2), 0, 0, np.sin(angle/2),
+    .5 + .08*(j % 10) + .03*layer, -.2 + .08*(j // 10), .8 + .12*layer]))
+
+dynamic_names = ['mug_%d' % i for i in range(n_mugs)]
+steps = 200
+
+def run(n_threads):
+  bulletsimpy.sim_params.solverType = 0
+  bulletsimpy.sim_params.numThreads = n_threads
+  bt_env = bulletsimpy.BulletEnvironment(env, dynamic_names)
+  bt_env.SetGravity([0, 0, -9.8])
+  t_start = time.time()
+  for i in range(steps):
+    bt_env.Step(0.01, 100, .01)
+  t_elapsed = time.time() - t_start
+  n_contacts = len(bt_env.DetectAllCollisions())
+  print 'threads:', n_threads, 'mugs:', n_mugs, 'contacts at the end:', n_contacts, 'took', t_elapsed, 'steps/sec', steps/t_elapsed
+
+for n_threads in [1, 2, 4, 8]:
+  run(n_threads)
@@ -0,0 +1,44 @@
+import openravepy as rave
+import bulletsimpy
+import numpy as np
+import time
+
+# checks that DetectAllCollisionsBatch agrees with DetectAllCollisions, and compares their speed
+
+env = rave.Environment()
+env.Load('data/lab1.env.xml')
+
+dyn_obj_names = ['mug1', 'mug2', 'mug3', 'mug4', 'mug5']
+bullet_env = bulletsimpy.BulletEnvironment(env, dyn_obj_names)
+bullet_env.SetGravity([0, 0, -9.8])
+bullet_env.SetContactDistance(.05)
+for t in range(20):
+  bullet_env.Step(0.01, 100, 0.01)
+
+collisions = bullet_env.DetectAllCollisions()
+batch = bullet_env.DetectAllCollisionsBatch()
+print 'contacts:', len(collisions), len(batch)
+assert len(collisions) == len(batch)
+for i, c in enumerate(collisions):
+  link = env.GetBodyFromEnvironmentId(int(batch.bodyA[i])).GetLinks()[batch.linkA[i]]
+  assert link.GetParent().GetName() == c.linkA.GetParent().GetName() and link.GetName() == c.linkA.GetName()
+  assert np.allclose(batch.ptA[i], c.ptA) and np.allclose(batch.normalB2A[i], c.normalB2A)
+  assert np.isclose(batch.distance[i], c.distance) and np.isclose(batch.weight[i], c.weight)
+print 'batch matches'
+
+iters = 1000
+t_start = time.time()
+for i in range(iters):
+  collisions = bullet_env.DetectAllCollisions()
+  pts = np.array([c.ptA for c in collisions])
+  dists = np.array([c.distance for c in collisions])
+t_elapsed = time.time() - t_start
+print 'DetectAllCollisions:', t_elapsed/iters*1000, 'ms'
+
+t_start = time.time()
+for i in range(iters):
+  batch = bullet_env.DetectAllCollisionsBatch(batch)
+  pts = batch.ptA
+  dists = batch.distance
+t_elapsed = time.time() - t_start
+print 'DetectAllCollisionsBatch:', t_elapsed/iters*1000, 'ms'
@@ -0,0 +1,45 @@
+import openravepy as rave
+import bulletsimpy
+import numpy as np
+import time
+
+# checks ComputeDistances against contact distances from stepping, and that it doesn't change the world
+
+env = rave.Environment()
+env.Load('data/lab1.env.xml')
+robot = env.GetRobots()[0]
+
+dyn_obj_names = ['mug1', 'mug2', 'mug3', 'mug4', 'mug5']
+bullet_env = bulletsimpy.BulletEnvironment(env, dyn_obj_names)
+bullet_env.SetGravity([0, 0, -9.8])
+for t in range(20):
+  bullet_env.Step(0.01, 100, 0.01)
+bt_robot = bullet_env.GetObjectByName(robot.GetName())
+
+max_dist = .05
+transforms = bullet_env.GetTransforms()
+dists = bullet_env.ComputeDistances([bt_robot], max_dist)
+print 'pairs within', max_dist, ':', len(dists)
+assert (dists.distance <= max_dist + 1e-6).all()
+assert (dists.bodyA == robot.GetEnvironmentId()).all() and (dists.bodyB != robot.GetEnvironmentId()).all()
+again = bullet_env.ComputeDistances([bt_robot], max_dist)
+assert np.allclose(again.distance, dists.distance)
+assert np.allclose(bullet_env.GetTransforms(), transforms)
+
+# the same pairs should show up in the manifolds after a step with the contact distance raised
+bullet_env.SetContactDistance(max_dist)
+bullet_env.Step(0.01, 100, 0.01)
+stepped = bullet_env.DetectAllCollisionsBatch()
+closest = {}
+for i in range(len(stepped)):
+  key = frozenset([(stepped.bodyA[i], stepped.linkA[i]), (stepped.bodyB[i], stepped.linkB[i])])
+  closest[key] = min(closest.get(key, np.inf), stepped.distance[i])
+for i in range(len(dists)):
+  key = frozenset([(dists.bodyA[i], dists.linkA[i]), (dists.bodyB[i], dists.linkB[i])])
+  print 'link pair', sorted(key), 'ComputeDistances:', dists.distance[i], 'manifold:', closest.get(key)
+
+iters = 1000
+t_start = time.time()
+for i in range(iters):
+  dists = bullet_env.ComputeDistances([bt_robot], max_dist, dists)
+print 'ComputeDistances:', (time.time() - t_start)/iters*1000, 'ms'
@@ -0,0 +1,55 @@
+import openravepy
+import bulletsimpy
+import numpy as np
+import time
+
+# compares BulletEnvironment construction time with serial and parallel link shape building
+
+env = openravepy.Environment()
+env.Load('robots/pr2-beta-static.zae')
+env.Load('data/table.xml')
+
+n_mugs = 200
+for i in range(n_mugs):
+  mug = env.ReadKinBodyURI('data/mug1.kinbody.xml')
+  mug.SetName('mug_%d' % i)
+  env.Add(mug)
+  mug.SetTransform(openravepy.matrixFromPose([1, 0, 0, 0, 1 + .1*(i % 20), -1 + .1*(i // 20), .8]))
+
+bodies = env.GetBodies()
+n_links = sum(len(body.GetLinks()) for body in bodies)
+dynamic_names = ['mug_%d' % i for i in range(n_mugs)]
+
+# cold: the shape cache is cleared before every load, so the hulls are rebuilt
+def run(n_threads, cold, iters=5):
+  bulletsimpy.sim_params.loadThreads = n_threads
+  t_elapsed = 0
+  for i in range(iters):
+    if cold: bulletsimpy.ClearShapeCache()
+    t_start = time.time()
+    bt_env = bulletsimpy.BulletEnvironment(env, dynamic_names)
+    t_elapsed += time.time() - t_start
+  print 'cold' if cold else 'warm', 'load threads:', n_threads, 'bodies:', len(bodies), 'links:', n_links, 'took', t_elapsed/iters*1e3, 'ms'
+
+for cold in [True, False]:
+  for n_threads in [1, 2, 4, 0]:
+    run(n_threads, cold)
+
+# both settings must build the same shapes: compare closest points between all links,
+# with the shapes built from scratch each time
+def link_distances(bt_env):
+  dists = bt_env.ComputeDistances(bt_env.GetObjects(), .2)
+  keys = zip(dists.bodyA, dists.linkA, dists.bodyB, dists.linkB)
+  order = sorted(range(len(keys)), key=lambda i: keys[i])
+  return [keys[i] for i in order], dists.distance[order], dists.ptA[order], dists.ptB[order]
+
+results = []
+for n_threads in [1, 0]:
+  bulletsimpy.sim_params.loadThreads = n_threads
+  bulletsimpy.ClearShapeCache()
+  results.append(link_distances(bulletsimpy.BulletEnvironment(env, dynamic_names)))
+serial, parallel = results
+assert len(serial[0]) > 0 and serial[0] == parallel[0]
+for a, b in zip(serial[1:], parallel[1:]):
+  assert np.allclose(a, b)
+print 'serial and parallel loads agree on', len(serial[0]), 'link distances'
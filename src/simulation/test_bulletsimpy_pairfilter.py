@@ -0,0 +1,35 @@
+import openravepy as rave
+import bulletsimpy
+import time
+
+# a dynamic robot's adjacent links are filtered out of the broadphase; sampling disables the
+# link pairs that can't touch as well. compares the pairs and step times before and after
+
+env = rave.Environment()
+env.Load('data/lab1.env.xml')
+robot = env.GetRobots()[0]
+
+bullet_env = bulletsimpy.BulletEnvironment(env, [robot.GetName()])
+bullet_env.SetGravity([0, 0, 0])
+bt_robot = bullet_env.GetObjectByName(robot.GetName())
+
+def run(steps=100):
+  bullet_env.ResetStepProfile()
+  t_start = time.time()
+  for t in range(steps):
+    bullet_env.Step(0.01, 100, 0.01)
+  counters = bullet_env.GetStepProfile()['counters']
+  return (time.time() - t_start)/steps*1000, counters['overlappingPairs']['last'], counters['manifolds']['last']
+
+print 'adjacent links disabled: %.3f ms/step, %d pairs, %d manifolds' % run()
+t_start = time.time()
+n = bt_robot.DisableNeverCollidingLinks(1000)
+print 'sampling disabled', n, 'more link pairs in', time.time() - t_start, 's'
+assert n > 0
+print 'never colliding disabled: %.3f ms/step, %d pairs, %d manifolds' % run()
+assert bt_robot.DisableNeverCollidingLinks(1000) == 0
+try:
+  bt_robot.DisableNeverCollidingLinks(0)
+  assert False, 'samples=0 should be rejected'
+except RuntimeError:
+  pass
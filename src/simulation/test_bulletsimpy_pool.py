@@ -0,0 +1,30 @@
+import openravepy as rave
+import bulletsimpy
+import time
+
+env = rave.Environment()
+env.Load('data/lab1.env.xml')
+
+dyn_obj_names = ['mug1', 'mug2', 'mug3', 'mug4', 'mug5']
+n_envs = 64
+steps = 100
+
+for n_threads in [1, 2, 4, 8]:
+  pool = bulletsimpy.EnvironmentPool(env, dyn_obj_names, n_envs, n_threads)
+  for e in pool.GetEnvironments():
+    e.SetGravity([0, 0, -9.8])
+
+  t_start = time.time()
+  for t in range(steps):
+    pool.StepAll(0.01, 100, 0.01)
+  t_elapsed = time.time() - t_start
+  print 'threads:', pool.GetNumThreads(), 'envs:', pool.Size(), 'took', t_elapsed, 'env steps/sec', n_envs*steps/t_elapsed
+
+# same thing, one environment at a time
+envs = [bulletsimpy.BulletEnvironment(env, dyn_obj_names) for i in range(n_envs)]
+t_start = time.time()
+for t in range(steps):
+  for e in envs:
+    e.Step(0.01, 100, 0.01)
+t_elapsed = time.time() - t_start
+print 'sequential Step:', 'took', t_elapsed, 'env steps/sec', n_envs*steps/t_elapsed
@@ -0,0 +1,55 @@
+import openravepy
+import bulletsimpy
+import numpy as np
+import time
+
+# compares rope simulation speed with the sequential impulse and the parallel constraint solvers
+
+env = openravepy.Environment()
+env.Load('data/table.xml')
+
+rope_params = bulletsimpy.CapsuleRopeParams()
+rope_params.radius = 0.005
+rope_params.angStiffness = .1
+rope_params.angDamping = .5
+rope_params.linDamping = 0
+rope_params.angLimit = .4
+rope_params.linStopErp = .2
+
+n = 200
+c = np.array([.5, .3, .7])
+pts = np.array(np.c_[np.zeros(n), np.linspace(0, 1, n), np.zeros(n)]) + c
+steps = 200
+
+def run(solver_type, n_threads):
+  bulletsimpy.sim_params.solverType = solver_type
+  bulletsimpy.sim_params.numThreads = n_threads
+  bt_env = bulletsimpy.BulletEnvironment(env, [])
+  rope = bulletsimpy.CapsuleRope(bt_env, 'rope', pts, rope_params)
+  t_start = time.time()
+  for i in range(steps):
+    bt_env.Step(0.01, 200, .005)
+  t_elapsed = time.time() - t_start
+  print 'solver:', solver_type, 'threads:', n_threads, 'links:', n, 'took', t_elapsed, 'steps/sec', steps/t_elapsed
+  print '  rope end:', rope.GetNodes()[-1]
+
+# the narrowphase threads are used by both solvers, so run both at each thread count
+for n_threads in [1, 2, 4, 8]:
+  run(0, n_threads)
+  run(1, n_threads)
+
+# reading the rope state back, with and without reusing output arrays
+bt_env = bulletsimpy.BulletEnvironment(env, [])
+rope = bulletsimpy.CapsuleRope(bt_env, 'rope', pts, rope_params)
+iters = 10000
+t_start = time.time()
+for i in range(iters):
+  rots = rope.GetRotations()
+  trans = rope.GetTranslations()
+print 'state readback, new arrays:', (time.time() - t_start)/iters*1e6, 'us'
+rots_out, trans_out = rope.GetRotations(), rope.GetTranslations()
+t_start = time.time()
+for i in range(iters):
+  rope.GetRotations(rots_out)
+  rope.GetTranslations(out=trans_out)
+print 'state readback, preallocated:', (time.time() - t_start)/iters*1e6, 'us'
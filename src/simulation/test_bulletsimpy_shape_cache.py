@@ -0,0 +1,75 @@
+import openravepy
+import bulletsimpy
+import numpy as np
+import tempfile
+import shutil
+
+# checks that reloading a scene hits the shape cache, in memory and from disk, in every
+# trimesh mode, and that cached shapes collide exactly like freshly built ones
+
+env = openravepy.Environment()
+env.Load('data/lab1.env.xml')
+dyn_obj_names = ['mug1', 'mug2', 'mug3', 'mug4', 'mug5']
+
+def load(mode, cache_dir=''):
+  bulletsimpy.sim_params.trimeshMode = mode
+  bulletsimpy.sim_params.shapeCacheDir = cache_dir
+  before = bulletsimpy.GetShapeCacheStats()
+  bt_env = bulletsimpy.BulletEnvironment(env, dyn_obj_names)
+  after = bulletsimpy.GetShapeCacheStats()
+  return bt_env, dict((k, after[k] - before[k]) for k in after)
+
+def collision_results(bt_env):
+  # closest points between all links, then the contacts after letting the mugs settle
+  dists = bt_env.ComputeDistances(bt_env.GetObjects(), .1)
+  bt_env.SetGravity([0, 0, -9.8])
+  for t in range(10):
+    bt_env.Step(0.01, 100, 0.01)
+  contacts = bt_env.DetectAllCollisionsBatch()
+  results = []
+  for batch in [dists, contacts]:
+    keys = zip(batch.bodyA, batch.linkA, batch.bodyB, batch.linkB)
+    order = sorted(range(len(keys)), key=lambda i: keys[i])
+    results.append(([keys[i] for i in order], batch.distance[order], batch.ptA[order]))
+  return results
+
+def assert_same(a, b):
+  for (keys_a, dist_a, pt_a), (keys_b, dist_b, pt_b) in zip(a, b):
+    assert keys_a == keys_b
+    assert np.allclose(dist_a, dist_b) and np.allclose(pt_a, pt_b)
+
+modes = [('convex hull', bulletsimpy.TRIMESH_CONVEX_HULL),
+         ('raw', bulletsimpy.TRIMESH_RAW),
+         ('convex decomposition', bulletsimpy.TRIMESH_CONVEX_DECOMPOSITION)]
+num_shapes = {}
+cache_dir = tempfile.mkdtemp()
+try:
+  for name, mode in modes:
+    bulletsimpy.ClearShapeCache()
+    built, stats = load(mode)
+    print name, 'first load:', stats
+    assert stats['misses'] > 0
+    # built stays alive, so the shared meshes and BVHs are still cached too
+    reloaded, stats = load(mode)
+    print name, 'second load:', stats
+    assert stats['misses'] == 0 and stats['memoryHits'] > 0
+    expected = collision_results(built)
+    assert_same(expected, collision_results(reloaded))
+
+    bulletsimpy.ClearShapeCache()
+    written, stats = load(mode, cache_dir)
+    assert stats['misses'] > 0
+    bulletsimpy.ClearShapeCache()
+    read, stats = load(mode, cache_dir)
+    print name, 'load from', cache_dir, ':', stats
+    assert stats['misses'] == 0 and stats['diskHits'] > 0
+    assert_same(expected, collision_results(read))
+    num_shapes[mode] = read.GetObjectByName('mug1').GetNumCollisionShapes()
+finally:
+  bulletsimpy.sim_params.shapeCacheDir = ''
+  bulletsimpy.sim_params.trimeshMode = bulletsimpy.TRIMESH_CONVEX_HULL
+  shutil.rmtree(cache_dir)
+
+print 'mug1 collision shapes:', dict((name, num_shapes[mode]) for name, mode in modes)
+assert num_shapes[bulletsimpy.TRIMESH_CONVEX_DECOMPOSITION] > num_shapes[bulletsimpy.TRIMESH_CONVEX_HULL]
+print 'shape cache ok'
@@ -0,0 +1,39 @@
+import openravepy
+import bulletsimpy
+import numpy as np
+
+# checks that SaveState/RestoreState rolls back exactly: stepping again from a restored
+# state must reproduce the same transforms, bit for bit
+
+env = openravepy.Environment()
+env.Load('data/lab1.env.xml')
+dyn_obj_names = ['mug1', 'mug2', 'mug3', 'mug4', 'mug5']
+
+bt_env = bulletsimpy.BulletEnvironment(env, dyn_obj_names)
+bt_env.SetGravity([0, 0, -9.8])
+dyn_objs = [bt_env.GetObjectByName(name) for name in dyn_obj_names]
+
+# tip the mugs over and spin them, so they're tumbling on the table when the state is saved.
+# the step size isn't a multiple of the substep, so there's a substep remainder to restore too
+for i, obj in enumerate(dyn_objs):
+  T = obj.GetTransform()
+  T[:3,:3] = openravepy.rotationMatrixFromAxisAngle([1, 0, 0], .4*(i+1)).dot(T[:3,:3])
+  T[2,3] += .05
+  obj.SetTransform(T)
+  obj.SetAngularVelocity([3, -2, 5])
+for t in range(40):
+  bt_env.Step(0.013, 100, 0.01)
+
+state = bt_env.SaveState()
+for t in range(31):
+  bt_env.Step(0.013, 100, 0.01)
+first = bt_env.GetTransforms(dyn_objs)
+
+bt_env.RestoreState(state)
+for t in range(31):
+  bt_env.Step(0.013, 100, 0.01)
+second = bt_env.GetTransforms(dyn_objs)
+
+print 'max difference after rollback:', np.abs(first - second).max()
+assert np.array_equal(first, second)
+print 'rollback ok'
@@ -0,0 +1,51 @@
+import openravepy
+import bulletsimpy
+import numpy as np
+import time
+
+# StepN records a rollout in one call; check it against stepping from python
+
+env = openravepy.Environment()
+env.Load('data/table.xml')
+
+rope_params = bulletsimpy.CapsuleRopeParams()
+rope_params.radius = 0.005
+rope_params.angStiffness = .1
+rope_params.angDamping = .5
+rope_params.linDamping = 0
+rope_params.angLimit = .4
+rope_params.linStopErp = .2
+
+n = 30
+c = np.array([.5, .3, .9])
+pts = np.array(np.c_[np.zeros(n), np.linspace(0, .5, n), np.zeros(n)]) + c
+steps = 300
+
+def make_env(name):
+  bt_env = bulletsimpy.BulletEnvironment(env, [])
+  rope = bulletsimpy.CapsuleRope(bt_env, name, pts, rope_params)
+  return bt_env, rope
+
+bt_env, rope = make_env('rope_loop')
+t_start = time.time()
+nodes_loop = []
+for i in range(steps):
+  bt_env.Step(0.01, 200, .005)
+  nodes_loop.append(rope.GetNodes())
+nodes_loop = np.array(nodes_loop)
+print 'python loop:', time.time() - t_start, 's'
+
+bt_env, rope = make_env('rope_stepn')
+t_start = time.time()
+n_run, transforms, nodes = bt_env.StepN(steps, 0.01, 200, .005, ropes=[rope])
+print 'StepN:', time.time() - t_start, 's'
+assert n_run == steps
+assert transforms.shape == (steps, 0, 4, 4)
+assert nodes.shape == nodes_loop.shape
+print 'max difference:', abs(nodes - nodes_loop).max()
+
+# stop as soon as the rope hits the table, reusing the output array
+bt_env, rope = make_env('rope_contact')
+n_run, _, nodes = bt_env.StepN(steps, 0.01, 200, .005, ropes=[rope], nodes_out=nodes, stopOn=bulletsimpy.STOP_ON_CONTACT)
+print 'rope hit the table after', n_run, 'steps, lowest node at', nodes[n_run-1,:,2].min()
+assert n_run < steps
@@ -0,0 +1,53 @@
+import openravepy
+import bulletsimpy
+import numpy as np
+
+# checks which objects SyncToRave and SyncFromRave update
+
+env = openravepy.Environment()
+env.Load('data/lab1.env.xml')
+dyn_obj_names = ['mug1', 'mug2', 'mug3', 'mug4', 'mug5']
+
+bt_env = bulletsimpy.BulletEnvironment(env, dyn_obj_names)
+bt_env.SetGravity([0, 0, -9.8])
+mug1 = bt_env.GetObjectByName('mug1')
+
+def rave_matches(obj):
+  return np.allclose(obj.GetKinBody().GetTransform(), obj.GetTransform(), atol=1e-5)
+
+# SyncToRave: every dynamic object is written the first time, then only those that moved
+assert bt_env.SyncToRave() == len(dyn_obj_names)
+assert bt_env.SyncToRave() == 0
+
+T = mug1.GetTransform()
+T[2,3] += .001
+mug1.SetTransform(T)
+assert bt_env.SyncToRave(.01) == 0, 'a 1mm move is below the threshold'
+assert not rave_matches(mug1)
+assert bt_env.SyncToRave(0) == 1
+assert rave_matches(mug1)
+
+# a body that moved and then fell asleep between two syncs is still written
+T[2,3] += .2
+mug1.SetTransform(T)
+for t in range(500):
+  bt_env.Step(0.01, 100, 0.01)
+T_rest = mug1.GetTransform()
+for t in range(10):
+  bt_env.Step(0.01, 100, 0.01)
+assert np.array_equal(mug1.GetTransform(), T_rest), 'mug1 should be asleep by now'
+assert bt_env.SyncToRave(.01) >= 1
+assert rave_matches(mug1)
+assert bt_env.SyncToRave(.01) == 0
+
+# SyncFromRave: only the kinematic objects whose KinBody changed since the last sync
+bt_env.SyncFromRave()
+assert bt_env.SyncFromRave() == 0
+static_obj = [o for o in bt_env.GetObjects() if o.IsKinematic() and not o.GetKinBody().IsRobot()][0]
+T_static = static_obj.GetKinBody().GetTransform()
+T_static[0,3] += .1
+static_obj.GetKinBody().SetTransform(T_static)
+assert bt_env.SyncFromRave() == 1
+assert rave_matches(static_obj)
+assert bt_env.SyncFromRave() == 0
+print 'sync ok'
@@ -0,0 +1,51 @@
+import openravepy as rave
+import bulletsimpy
+import numpy as np
+import time
+
+# checks CheckTrajectory against setting each waypoint and running ContactTest, and compares their speed,
+# then checks a coarser trajectory continuously
+
+env = rave.Environment()
+env.Load('data/lab1.env.xml')
+robot = env.GetRobots()[0]
+
+bullet_env = bulletsimpy.BulletEnvironment(env, [])
+bt_robot = bullet_env.GetObjectByName(robot.GetName())
+
+dofs = robot.GetActiveManipulator().GetArmIndices()
+lower, upper = robot.GetDOFLimits(dofs)
+n = 500
+start = robot.GetDOFValues(dofs)
+goal = lower + (upper - lower) * np.random.rand(len(dofs))
+traj = start + np.linspace(0, 1, n)[:,None] * (goal - start)
+
+def waypoint_collides(values):
+  robot.SetDOFValues(values, dofs)
+  bt_robot.UpdateBullet()
+  return any(c.linkA.GetParent() != c.linkB.GetParent() for c in bullet_env.ContactTest(bt_robot))
+
+t_start = time.time()
+mask_loop = np.array([waypoint_collides(values) for values in traj])
+print 'python loop:', time.time() - t_start, 's'
+robot.SetDOFValues(start, dofs)
+bt_robot.UpdateBullet()
+
+t_start = time.time()
+first = bullet_env.CheckTrajectory(bt_robot, dofs, traj)
+print 'CheckTrajectory:', time.time() - t_start, 's'
+mask = bullet_env.CheckTrajectory(bt_robot, dofs, traj, return_mask=True)
+print 'colliding waypoints:', mask.sum(), 'of', n, 'first:', first
+assert (mask == mask_loop).all()
+assert first == (np.flatnonzero(mask)[0] if mask.any() else -1)
+assert np.allclose(robot.GetDOFValues(dofs), start)
+
+# a coarse trajectory, swept between waypoints, should catch what the fine one hits
+k = 10
+coarse = traj[::k]
+t_start = time.time()
+mask_swept = bullet_env.CheckTrajectory(bt_robot, dofs, coarse, return_mask=True, continuous=True)
+print 'CheckTrajectory continuous, %d waypoints:' % len(coarse), time.time() - t_start, 's'
+assert (mask_swept >= mask[::k]).all()
+fine_hits = np.array([mask[i*k:(i+1)*k+1].any() for i in range(len(coarse))])
+print 'segments hit by the fine trajectory but not the sweep:', (fine_hits & ~mask_swept).sum(), 'of', fine_hits.sum()
@@ -0,0 +1,85 @@
+#include "thread_pool.h"
+#include <stdexcept>
+
+int ThreadPool::hardwareThreads() {
+  int n = boost::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+ThreadPool::ThreadPool(int nThreads) :
+  m_func(NULL), m_n(0), m_next(0), m_done(0), m_generation(0), m_stop(false) {
+  if (nThreads <= 0) nThreads = hardwareThreads();
+  m_workers.reserve(nThreads - 1);
+  for (int i = 0; i < nThreads - 1; ++i)
+    m_workers.push_back(new boost::thread(&ThreadPool::workerLoop, this));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    m_stop = true;
+    m_workCond.notify_all();
+  }
+  for (int i = 0; i < m_workers.size(); ++i) {
+    m_workers[i]->join();
+    delete m_workers[i];
+  }
+}
+
+void ThreadPool::runTasks(boost::unique_lock<boost::mutex> &lock) {
+  // grab indices one at a time; tasks are coarse (e.g. a whole simulation step)
+  // so the lock is never contended for long
+  while (m_next < m_n) {
+    int i = m_next++;
+    const IndexFunc &f = *m_func;
+    lock.unlock();
+    std::string error;
+    try {
+      f(i);
+    } catch (const std::exception &e) {
+      error = e.what();
+    } catch (...) {
+      error = "unknown exception in ThreadPool task";
+    }
+    lock.lock();
+    if (!error.empty() && m_error.empty()) m_error = error;
+    if (++m_done == m_n) m_doneCond.notify_all();
+  }
+}
+
+void ThreadPool::workerLoop() {
+  boost::unique_lock<boost::mutex> lock(m_mutex);
+  unsigned int seen = m_generation;
+  while (true) {
+    while (!m_stop && seen == m_generation)
+      m_workCond.wait(lock);
+    if (m_stop) return;
+    seen = m_generation;
+    runTasks(lock);
+  }
+}
+
+void ThreadPool::parallelFor(int n, const IndexFunc &f) {
+  if (n <= 0) return;
+  boost::mutex::scoped_lock callLock(m_callMutex);
+
+  boost::unique_lock<boost::mutex> lock(m_mutex);
+  m_func = &f;
+  m_n = n;
+  m_next = 0;
+  m_done = 0;
+  m_error.clear();
+  ++m_generation;
+  if (n > 1) m_workCond.notify_all();
+
+  runTasks(lock);
+  while (m_done < m_n)
+    m_doneCond.wait(lock);
+  m_func = NULL;
+
+  if (!m_error.empty()) {
+    std::string error;
+    error.swap(m_error);
+    throw std::runtime_error(error);
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <vector>
+#include <string>
+
+// A fixed set of worker threads for index-parallel loops.
+// parallelFor(n, f) calls f(i) for every i in [0, n) and returns once all calls
+// have finished. The calling thread takes part in the loop, so a pool with
+// numThreads() == 1 has no workers and just runs the loop serially.
+//
+// Calls to parallelFor from different threads are serialized. Calling parallelFor
+// from inside a task of the same pool deadlocks.
+class ThreadPool {
+public:
+  typedef boost::shared_ptr<ThreadPool> Ptr;
+  typedef boost::function<void (int)> IndexFunc;
+
+  // nThreads <= 0 means one thread per hardware core
+  explicit ThreadPool(int nThreads=0);
+  ~ThreadPool();
+
+  int numThreads() const { return m_workers.size() + 1; }
+
+  // if a task throws, the remaining tasks still run and the first
+  // error is rethrown as a std::runtime_error in the calling thread
+  void parallelFor(int n, const IndexFunc &f);
+
+  // number of hardware threads, at least 1
+  static int hardwareThreads();
+
+private:
+  ThreadPool(const ThreadPool &);
+  ThreadPool &operator=(const ThreadPool &);
+
+  void workerLoop();
+  void runTasks(boost::unique_lock<boost::mutex> &lock);
+
+  boost::mutex m_callMutex; // serializes parallelFor callers
+  boost::mutex m_mutex; // protects everything below
+  boost::condition_variable m_workCond, m_doneCond;
+  std::vector<boost::thread *> m_workers;
+
+  const IndexFunc *m_func;
+  int m_n, m_next, m_done;
+  unsigned int m_generation;
+  bool m_stop;
+  std::string m_error;
+};